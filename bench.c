@@ -0,0 +1,335 @@
+/*
+Copyright 2026 by Thomas E. Dickey
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <luit.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
+
+#if defined(HAVE_MALLINFO2) && defined(HAVE_MALLOC_H)
+#define USE_MALLINFO 1
+#include <malloc.h>
+#endif
+
+#include <sys.h>
+#include <bench.h>
+
+/*
+ * Replay a captured stream through copyOut(), or copyIn() for keyboard input,
+ * writing to an in-memory sink rather than a pty, and report the speed.
+ *
+ * The stream is fed in chunks of the current read size, as parent() would
+ * read it, and is repeated until BENCH_SECONDS have passed.
+ */
+static int sink_counting;
+static size_t sink_bytes;
+static size_t sink_chars;
+
+static size_t
+countUTF8(const unsigned char *data, size_t count)
+{
+    size_t result = 0;
+    size_t n;
+
+    for (n = 0; n < count; ++n) {
+	if ((data[n] & 0xC0) != 0x80)
+	    ++result;
+    }
+    return result;
+}
+
+static void
+benchSink(Iso2022Ptr is GCC_UNUSED, const unsigned char *data, size_t count)
+{
+    if (sink_counting) {
+	sink_bytes += count;
+	sink_chars += countUTF8(data, count);
+    }
+}
+
+static unsigned char *
+readCapture(const char *filename, size_t *length)
+{
+    unsigned char *result = NULL;
+    struct stat sb;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+	perror(filename);
+    } else {
+	if (fstat(fd, &sb) == 0
+	    && sb.st_size > 0
+	    && (result = malloc((size_t) sb.st_size)) != NULL) {
+	    *length = (size_t) sb.st_size;
+	    if (read(fd, result, *length) != (ssize_t) * length) {
+		perror(filename);
+		free(result);
+		result = NULL;
+	    }
+	}
+	close(fd);
+    }
+    return result;
+}
+
+static long
+peakMemory(void)
+{
+    long result = 0;
+#ifdef HAVE_GETRUSAGE
+    struct rusage usage;
+
+    /* Linux and the BSDs report kilobytes; macOS reports bytes */
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+	result = (long) usage.ru_maxrss;
+#endif
+    return result;
+}
+
+/*
+ * The startup profile charges each phase for the time, iconv() calls and heap
+ * growth between its beginPhase() and endPhase(), less that of any phases
+ * nested within it.
+ */
+#define MAX_PHASES 16
+#define MAX_NESTING 8
+
+typedef struct {
+    double wall;
+    double cpu;
+    unsigned long iconv;
+    long heap;
+} PhaseSample;
+
+typedef struct {
+    const char *name;
+    unsigned long calls;
+    PhaseSample used;
+} PhaseRec;
+
+int startup_profile = 0;
+unsigned long iconv_calls = 0;
+
+static PhaseRec phases[MAX_PHASES];
+static unsigned num_phases;
+static struct {
+    PhaseRec *phase;
+    PhaseSample since;
+} nesting[MAX_NESTING];
+static unsigned depth;
+static unsigned too_deep;	/* phases not recorded, beyond MAX_NESTING */
+
+static void
+samplePhase(PhaseSample * p)
+{
+#ifdef HAVE_GETRUSAGE
+    struct rusage usage;
+#endif
+#ifdef USE_MALLINFO
+    struct mallinfo2 info = mallinfo2();
+    p->heap = (long) (info.uordblks + info.hblkhd);
+#else
+    p->heap = 0;
+#endif
+    p->wall = getSeconds();
+    p->cpu = 0.0;
+#ifdef HAVE_GETRUSAGE
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+	p->cpu = ((double) usage.ru_utime.tv_sec
+		  + (double) usage.ru_utime.tv_usec / 1.0e6
+		  + (double) usage.ru_stime.tv_sec
+		  + (double) usage.ru_stime.tv_usec / 1.0e6);
+    }
+#endif
+    p->iconv = iconv_calls;
+}
+
+/* charge the innermost phase for its use since it last started or resumed */
+static void
+chargePhase(const PhaseSample * now)
+{
+    PhaseRec *phase = nesting[depth - 1].phase;
+    const PhaseSample *since = &nesting[depth - 1].since;
+
+    phase->used.wall += now->wall - since->wall;
+    phase->used.cpu += now->cpu - since->cpu;
+    phase->used.iconv += now->iconv - since->iconv;
+    phase->used.heap += now->heap - since->heap;
+}
+
+void
+beginPhase(const char *name)
+{
+    PhaseSample now;
+    PhaseRec *phase = NULL;
+    unsigned n;
+
+    if (!startup_profile)
+	return;
+
+    for (n = 0; n < num_phases; ++n) {
+	if (!strcmp(phases[n].name, name)) {
+	    phase = &phases[n];
+	    break;
+	}
+    }
+    if (phase == NULL && num_phases < MAX_PHASES) {
+	phase = &phases[num_phases++];
+	phase->name = name;
+    }
+    if (phase == NULL || depth >= MAX_NESTING) {
+	++too_deep;
+	return;
+    }
+
+    samplePhase(&now);
+    if (depth != 0)
+	chargePhase(&now);
+
+    phase->calls++;
+    nesting[depth].phase = phase;
+    nesting[depth].since = now;
+    ++depth;
+}
+
+void
+endPhase(void)
+{
+    PhaseSample now;
+
+    if (!startup_profile || depth == 0)
+	return;
+    if (too_deep != 0) {
+	--too_deep;
+	return;
+    }
+
+    samplePhase(&now);
+    chargePhase(&now);
+    if (--depth != 0)
+	nesting[depth - 1].since = now;
+}
+
+void
+reportPhases(void)
+{
+    PhaseSample total;
+    unsigned n;
+
+    if (!startup_profile)
+	return;
+
+    memset(&total, 0, sizeof(total));
+    fprintf(stderr, "%-16s %5s %10s %10s %8s %8s\n",
+	    "phase", "calls", "wall ms", "cpu ms", "iconv", "heap KB");
+    for (n = 0; n < num_phases; ++n) {
+	const PhaseRec *p = &phases[n];
+
+	fprintf(stderr, "%-16s %5lu %10.3f %10.3f %8lu %8ld\n",
+		p->name,
+		p->calls,
+		p->used.wall * 1.0e3,
+		p->used.cpu * 1.0e3,
+		p->used.iconv,
+		p->used.heap / 1024);
+	total.wall += p->used.wall;
+	total.cpu += p->used.cpu;
+	total.iconv += p->used.iconv;
+	total.heap += p->used.heap;
+    }
+    fprintf(stderr, "%-16s %5s %10.3f %10.3f %8lu %8ld\n",
+	    "total", "",
+	    total.wall * 1.0e3,
+	    total.cpu * 1.0e3,
+	    total.iconv,
+	    total.heap / 1024);
+    fflush(stderr);
+}
+
+int
+benchmark(Iso2022Ptr is, const char *filename, int input, const char *encoding)
+{
+    unsigned char *data;
+    size_t length = 0;
+    size_t chars;
+    size_t n;
+    unsigned long passes = 0;
+    double seconds;
+    double start;
+
+    if ((data = readCapture(filename, &length)) == NULL)
+	return -1;
+
+    is->sink = benchSink;
+    sink_counting = 1;
+    start = getSeconds();
+    do {
+	for (n = 0; n < length;) {
+	    size_t count = length - n;
+
+	    if (count > readSizeIso2022(is))
+		count = readSizeIso2022(is);
+	    if (input)
+		copyIn(is, -1, data + n, (int) count);
+	    else
+		copyOut(is, -1, data + n, (unsigned) count);
+	    n += count;
+	}
+	sink_counting = 0;
+	++passes;
+    } while ((seconds = getSeconds() - start) < BENCH_SECONDS);
+    is->sink = NULL;
+
+    /* keyboard input is UTF-8; the terminal output is UTF-8 */
+    chars = input ? countUTF8(data, length) : sink_chars;
+
+    printf("file:      %s\n", filename);
+    printf("encoding:  %s\n", NonNull(encoding));
+    printf("direction: %s\n", input ? "input" : "output");
+    printf("bytes:     %lu\n", (unsigned long) length);
+    printf("chars:     %lu\n", (unsigned long) chars);
+    printf("output:    %lu\n", (unsigned long) sink_bytes);
+    printf("passes:    %lu\n", passes);
+    printf("seconds:   %.3f\n", seconds);
+    printf("MB/s:      %.2f\n",
+	   ((double) length * (double) passes) / (seconds * 1.0e6));
+    printf("chars/s:   %.0f\n",
+	   ((double) chars * (double) passes) / seconds);
+    printf("ns/byte:   %.2f\n",
+	   (seconds * 1.0e9) / ((double) length * (double) passes));
+    printf("ns/char:   %.2f\n",
+	   (chars != 0)
+	   ? (seconds * 1.0e9) / ((double) chars * (double) passes)
+	   : 0.0);
+    printf("peak RSS:  %ld KB\n", peakMemory());
+    fflush(stdout);
+
+    free(data);
+    return 0;
+}
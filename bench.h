@@ -0,0 +1,44 @@
+/*
+Copyright 2026 by Thomas E. Dickey
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef LUIT_BENCH_H
+#define LUIT_BENCH_H 1
+
+#include <iso2022.h>
+
+#define BENCH_SECONDS 1.0	/* minimum time to repeat the replay */
+
+int benchmark(Iso2022Ptr, const char *, int, const char *);
+
+/*
+ * Startup profile: time, iconv calls and heap growth for each phase.
+ */
+#define ICONV(cd,ip,il,op,ol) (++iconv_calls, iconv(cd, ip, il, op, ol))
+
+extern int startup_profile;
+extern unsigned long iconv_calls;
+
+void beginPhase(const char *);
+void endPhase(void);
+void reportPhases(void);
+
+#endif /* LUIT_BENCH_H */
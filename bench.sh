@@ -0,0 +1,220 @@
+#!/bin/sh
+# -----------------------------------------------------------------------------
+# this file is part of luit
+#
+# Copyright 2026 by Thomas E. Dickey
+#
+#                         All Rights Reserved
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+# OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE ABOVE LISTED COPYRIGHT HOLDER(S) BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+# Except as contained in this notice, the name(s) of the above copyright
+# holders shall not be used in advertising or otherwise to promote the
+# sale, use or other dealings in this Software without prior written
+# authorization.
+# -----------------------------------------------------------------------------
+#
+# Generate deterministic corpora for several encodings, run each through
+# luit's "-bench" (output) and "-kbench" (input) modes, and write the results
+# as a tab-separated table.
+#
+# usage: bench.sh LUIT [DIRECTORY]
+#
+# Environment:
+#	BENCH_LINES	number of lines in each corpus (default 20000)
+#	ICONV		iconv program used to encode the corpora
+
+LANG=C;		export LANG
+LC_ALL=C;	export LC_ALL
+
+LUIT=${1:-./luit}
+DIR=${2:-bench-data}
+LINES=${BENCH_LINES:-20000}
+ICONV=${ICONV:-iconv}
+
+case "$LUIT" in
+/*)	;;
+*)	LUIT=`pwd`/$LUIT ;;
+esac
+
+if test ! -x "$LUIT" ; then
+	echo "? not an executable: $LUIT" >&2
+	exit 1
+fi
+
+mkdir -p "$DIR" || exit 1
+RESULTS=$DIR/results.tsv
+
+# Write UTF-8 text of the given kind to the standard output.  The random
+# number generator is Park-Miller, which is exact in awk's floating-point.
+generate() {
+	awk -v kind="$1" -v lines="$LINES" '
+	function rand31() {
+		seed = (seed * 16807) % 2147483647
+		return seed
+	}
+	function pick(lo, hi) {
+		return lo + rand31() % (hi - lo + 1)
+	}
+	function utf8(c) {
+		if (c < 128) {
+			return sprintf("%c", c)
+		} else if (c < 2048) {
+			return sprintf("%c%c",
+				192 + int(c / 64),
+				128 + c % 64)
+		} else if (c < 65536) {
+			return sprintf("%c%c%c",
+				224 + int(c / 4096),
+				128 + int(c / 64) % 64,
+				128 + c % 64)
+		}
+		return sprintf("%c%c%c%c",
+			240 + int(c / 262144),
+			128 + int(c / 4096) % 64,
+			128 + int(c / 64) % 64,
+			128 + c % 64)
+	}
+	# a word of "len" characters from the range lo..hi
+	function word(lo, hi, len,   n, s) {
+		s = ""
+		for (n = 0; n < len; ++n)
+			s = s utf8(pick(lo, hi))
+		return s
+	}
+	function ascii(len) {
+		return word(97, 122, len)
+	}
+	# a line of words, mixing the given range with ASCII words
+	function text(lo, hi, percent,   n, s, count) {
+		s = ""
+		count = pick(6, 14)
+		for (n = 0; n < count; ++n) {
+			if (n)
+				s = s " "
+			if (pick(0, 99) < percent)
+				s = s word(lo, hi, pick(2, 8))
+			else
+				s = s ascii(pick(2, 8))
+		}
+		return s
+	}
+	BEGIN {
+		seed = 20261017
+		levels[0] = "INFO"; levels[1] = "WARN"
+		levels[2] = "DEBUG"; levels[3] = "ERROR"
+		for (line = 0; line < lines; ++line) {
+			if (kind == "ascii") {
+				printf "2026-10-17 %02d:%02d:%02d %s worker[%d]: %s id=%08x status=%d bytes=%d\n", \
+					pick(0, 23), pick(0, 59), pick(0, 59),
+					levels[pick(0, 3)], pick(1000, 9999),
+					text(0, 0, 0), rand31(), pick(200, 504),
+					pick(0, 99999)
+			} else if (kind == "latin1") {
+				print text(192, 255, 40)
+			} else if (kind == "latin2") {
+				print text(256, 383, 30)
+			} else if (kind == "cyrillic") {
+				print text(1040, 1103, 80)
+			} else if (kind == "japanese") {
+				s = text(12353, 12435, 50)
+				print s " " word(12449, 12531, 4) word(19968, 20800, 6)
+			} else if (kind == "japanese3") {
+				# JIS X 0208 in G1, half-width katakana in G2
+				# (SS2) and JIS X 0212 accented Latin in G3 (SS3)
+				s = text(12353, 12435, 50)
+				print s " " word(65377, 65439, 4) " " word(192, 255, 4)
+			} else if (kind == "korean") {
+				print text(44032, 55203, 70)
+			} else if (kind == "hanzi") {
+				print text(19968, 21000, 70)
+			} else if (kind == "gb18030") {
+				# Hangul and CJK extension A use 4-byte sequences
+				print text(44032, 55203, 40) " " word(13312, 19893, 8)
+			} else if (kind == "tui") {
+				# screen redraw: cursor addressing, colors and short text
+				s = ""
+				for (n = 0; n < 8; ++n) {
+					s = s sprintf("\033[%d;%dH\033[%d;%dm", \
+						pick(1, 50), pick(1, 132),
+						pick(30, 37), pick(40, 47))
+					s = s word(12353, 12435, pick(1, 4))
+					s = s sprintf("\033[0m\033[K")
+				}
+				print s
+			}
+		}
+	}'
+}
+
+# corpus-name, generator-kind, luit encoding, iconv encoding
+CORPORA="
+ascii		ascii		ISO8859-1	ISO-8859-1
+iso8859-1	latin1		ISO8859-1	ISO-8859-1
+iso8859-2	latin2		ISO8859-2	ISO-8859-2
+koi8-r		cyrillic	KOI8-R		KOI8-R
+euc-jp		japanese	eucJP		EUC-JP
+euc-jp-g3	japanese3	eucJP		EUC-JP
+euc-kr		korean		eucKR		EUC-KR
+shift_jis	japanese	SJIS		SHIFT_JIS
+big5-hkscs	hanzi		Big5-HKSCS	BIG5-HKSCS
+gbk		hanzi		GBK		GBK
+gb18030		gb18030		GB18030		GB18030
+tui		tui		eucJP		EUC-JP
+"
+
+# Convert luit's "name: value" report into a row of the table.
+report() {
+	awk -F': *' -v corpus="$1" '
+	{ value[$1] = $2 }
+	END {
+		sub(/ KB$/, "", value["peak RSS"])
+		printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n", \
+			corpus, value["encoding"], value["direction"],
+			value["bytes"], value["chars"], value["MB/s"],
+			value["chars/s"], value["ns/byte"], value["ns/char"],
+			value["peak RSS"]
+	}'
+}
+
+printf '#corpus\tencoding\tdirection\tbytes\tchars\tMB/s\tchars/s\tns/byte\tns/char\trss_kb\n' >"$RESULTS"
+
+echo "$CORPORA" | while read corpus kind encoding charset
+do
+	test -z "$corpus" && continue
+	native=$DIR/$corpus.txt
+	utf8=$DIR/$corpus.utf8
+
+	# discard characters which the encoding cannot represent, and make
+	# the UTF-8 keyboard input from what remains
+	generate "$kind" | $ICONV -c -f UTF-8 -t "$charset" >"$native" 2>/dev/null
+	$ICONV -f "$charset" -t UTF-8 <"$native" >"$utf8" || exit 1
+
+	echo "** $corpus ($encoding)"
+	"$LUIT" +cache -encoding "$encoding" -bench "$native" | report "$corpus" >>"$RESULTS"
+	"$LUIT" +cache -encoding "$encoding" -kbench "$utf8" | report "$corpus" >>"$RESULTS"
+done
+
+echo "** results in $RESULTS"
+if type column >/dev/null 2>&1 ; then
+	column -t -s '	' "$RESULTS"
+else
+	cat "$RESULTS"
+fi
@@ -27,6 +27,7 @@ THE SOFTWARE.
 
 #include <sys.h>
 #include <parser.h>
+#include <bench.h>
 
 static unsigned int
 IdentityRecode(unsigned int n, const CharsetRec * self GCC_UNUSED)
@@ -40,7 +41,7 @@ NullReverse(unsigned int n GCC_UNUSED, const CharsetRec * self GCC_UNUSED)
     return -1;
 }
 
-#define NotKnown(name, code) {name, code, 0, IdentityRecode, NullReverse, NULL, NULL, NULL, NULL, NULL, NULL}
+#define NotKnown(name, code) {name, code, 0, IdentityRecode, NullReverse, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
 
 static const CharsetRec Unknown94Charset = NotKnown("Unknown (94)", T_94);
 static const CharsetRec Unknown96Charset = NotKnown("Unknown (96)", T_96);
@@ -202,10 +203,11 @@ FontencCharsetRecode(unsigned int n, const CharsetRec * self)
 
     result = MapCodeValue(n + fc->shift, fc->mapping);
 
-    TRACE(("FontencCharsetRecode %#x ->%#x%s\n",
-	   n,
-	   result,
-	   (n != result) ? " map" : ""));
+    TRACE_EVENT(evRECODE, n, result, 0,
+		("FontencCharsetRecode %#x ->%#x%s\n",
+		 n,
+		 result,
+		 (n != result) ? " map" : ""));
 
     return result;
 }
@@ -248,10 +250,11 @@ FontencCharsetReverse(unsigned int i, const CharsetRec * self)
 #undef IS_GL
     }
 
-    TRACE(("FontencCharsetReverse %#x ->%#x%s\n",
-	   i,
-	   result,
-	   ((int) i != result) ? " map" : ""));
+    TRACE_EVENT(evREVERSE, i, result, 0,
+		("FontencCharsetReverse %#x ->%#x%s\n",
+		 i,
+		 result,
+		 ((int) i != result) ? " map" : ""));
 
     return result;
 }
@@ -334,17 +337,212 @@ addFontencCharset(const char *name, FontEncPtr f)
     return result;
 }
 
+static unsigned
+encodeUTF8(unsigned char *target, unsigned c)
+{
+    unsigned result = 0;
+
+    if (c <= 0x7F) {
+	target[result++] = UChar(c);
+    } else if (c <= 0x7FF) {
+	target[result++] = UChar(0xC0 | ((c >> 6) & 0x1F));
+	target[result++] = UChar(0x80 | (c & 0x3F));
+    } else if (c <= 0xFFFF) {
+	target[result++] = UChar(0xE0 | ((c >> 12) & 0x0F));
+	target[result++] = UChar(0x80 | ((c >> 6) & 0x3F));
+	target[result++] = UChar(0x80 | (c & 0x3F));
+    } else if (c <= 0x1FFFFF) {
+	target[result++] = UChar(0xF0 | ((c >> 18) & 0x07));
+	target[result++] = UChar(0x80 | ((c >> 12) & 0x3F));
+	target[result++] = UChar(0x80 | ((c >> 6) & 0x3F));
+	target[result++] = UChar(0x80 | (c & 0x3F));
+    }
+    return result;
+}
+
+/*
+ * For an 8-bit charset, precompute the UTF-8 which copyOut() would produce
+ * for each byte, using the charset as GL (0-127) or as GR (128-255).
+ */
+static void
+compile8bitCharset(CharsetPtr c)
+{
+    CharsetUTF8 *table;
+    unsigned n;
+
+    if ((table = TypeCallocN(CharsetUTF8, 256)) == NULL)
+	return;
+
+    for (n = 0; n < 256; ++n) {
+	unsigned code = (n < 0x80) ? n : (n - 0x80);
+	unsigned ucs = n;
+
+	switch (c->type) {
+	case T_94:
+	    if (code >= 0x21 && code <= 0x7E)
+		ucs = c->recode(code, c);
+	    break;
+	case T_96:
+	    if (code >= 0x20)
+		ucs = c->recode(code, c);
+	    break;
+	case T_128:
+	    ucs = c->recode(code, c);
+	    break;
+	}
+
+	/* a zero codepoint is discarded, like outbufUTF8() */
+	if (ucs != 0) {
+	    table[n].size = UChar(encodeUTF8(table[n].text, ucs));
+	    if (table[n].size == 0) {
+		VERBOSE(2, ("...cannot compile %s\n", c->name));
+		free(table);
+		return;
+	    }
+	}
+    }
+    c->utf8 = table;
+}
+
+/*
+ * For a multibyte charset, precompute the Unicode value for every pair of
+ * bytes which copyOut() may pass to recode().  The first byte (less 0x80 for
+ * GR) is 0-127, and the second byte is limited by the charset type.
+ */
+static void
+compile16bitCharset(CharsetPtr c)
+{
+    CharsetTable *table;
+    unsigned row, col;
+
+    if ((table = TypeCalloc(CharsetTable)) == NULL)
+	return;
+
+    switch (c->type) {
+    case T_9494:
+	table->first = 0x21;
+	table->last = 0x7E;
+	break;
+    case T_9696:
+	table->first = 0x20;
+	table->last = 0x7F;
+	break;
+    case T_94192:
+	table->first = 0x21;
+	table->last = 0xFE;
+	break;
+    }
+    table->cols = table->last + 1 - table->first;
+
+    if ((table->ucs = TypeCallocN(unsigned, 0x80 * table->cols)) == NULL) {
+	free(table);
+	return;
+    }
+
+    for (row = 0; row < 0x80; ++row) {
+	for (col = table->first; col <= table->last; ++col) {
+	    table->ucs[(row * table->cols) + col - table->first] =
+		c->recode((row << 8) | col, c);
+	}
+    }
+    c->table = table;
+}
+
+/*
+ * Replace the chain of recode() calls with tables that copyOut() can index
+ * directly.
+ */
+static void
+compileCharset(CharsetPtr c)
+{
+    switch (c->type) {
+    case T_94:
+    case T_96:
+    case T_128:
+	compile8bitCharset(c);
+	break;
+    case T_9494:
+    case T_9696:
+    case T_94192:
+	compile16bitCharset(c);
+	break;
+    }
+}
+
+/*
+ * Look up the mapping for a FontEnc charset, and bind the real conversion
+ * functions to the charset.
+ */
+static int
+bindFontencCharset(CharsetPtr c, FontencCharsetPtr fc)
+{
+    FontMapPtr mapping;
+    FontMapReversePtr reverse;
+    int result = 0;
+
+    if ((mapping = LookupMapping(fc->xlfd, cpSize(fc))) == NULL) {
+	VERBOSE(2, ("...lookup mapping %s (%s) failed\n", NonNull(fc->name), fc->xlfd));
+	fc->type = T_FAILED;
+    } else if ((reverse = LookupReverse(mapping)) == NULL) {
+	VERBOSE(2, ("...lookup reverse %s failed\n", NonNull(fc->name)));
+	fc->type = T_FAILED;
+    } else {
+	fc->mapping = mapping;
+	fc->reverse = reverse;
+
+	c->recode = FontencCharsetRecode;
+	c->reverse = FontencCharsetReverse;
+	compileCharset(c);
+	result = 1;
+    }
+    return result;
+}
+
+/*
+ * A deferred charset has its name and type resolved, but its mapping is not
+ * looked up until the first call to recode() or reverse().  If the lookup
+ * fails then, the charset behaves like the unknown charset of its type.
+ */
 static CharsetPtr
-getFontencCharset(unsigned final, int type, const char *name)
+materializeCharset(const CharsetRec * self)
+{
+    /* only the records allocated by getFontencCharset() are lazy */
+    CharsetPtr c = (CharsetPtr) self;
+
+    VERBOSE(2, ("materializing '%s'\n", c->name));
+    if (!bindFontencCharset(c, c->fontenc)) {
+	c->recode = IdentityRecode;
+	c->reverse = NullReverse;
+    }
+    c->fontenc = NULL;
+    return c;
+}
+
+static unsigned int
+LazyCharsetRecode(unsigned int n, const CharsetRec * self)
+{
+    const CharsetRec *c = materializeCharset(self);
+
+    return c->recode(n, c);
+}
+
+static int
+LazyCharsetReverse(unsigned int i, const CharsetRec * self)
+{
+    const CharsetRec *c = materializeCharset(self);
+
+    return c->reverse(i, c);
+}
+
+static CharsetPtr
+getFontencCharset(unsigned final, int type, const char *name, int lazy)
 {
     FontencCharsetPtr fc;
     CharsetPtr c = NULL;
-    FontMapPtr mapping;
-    FontMapReversePtr reverse;
     CharsetPtr result = NULL;
 
-    TRACE(("getFontencCharset(final %#x, type %d, name %s)\n",
-	   final, type, NonNull(name)));
+    TRACE(("getFontencCharset(final %#x, type %d, name %s%s)\n",
+	   final, type, NonNull(name), lazy ? ", lazy" : ""));
 
     fc = fontencCharsets;
     while (fc->name) {
@@ -359,25 +557,21 @@ getFontencCharset(unsigned final, int type, const char *name)
 	VERBOSE(2, ("...no match for '%s' in FontEnc charsets\n", NonNull(name)));
     } else if ((c = TypeCalloc(CharsetRec)) == NULL) {
 	VERBOSE(2, ("malloc failed\n"));
-    } else if ((mapping = LookupMapping(fc->xlfd, cpSize(fc))) == NULL) {
-	VERBOSE(2, ("...lookup mapping %s (%s) failed\n", NonNull(name), fc->xlfd));
-	fc->type = T_FAILED;
-    } else if ((reverse = LookupReverse(mapping)) == NULL) {
-	VERBOSE(2, ("...lookup reverse %s failed\n", NonNull(name)));
-	fc->type = T_FAILED;
     } else {
-	fc->mapping = mapping;
-	fc->reverse = reverse;
-
 	c->name = fc->name;
 	c->type = fc->type;
 	c->final = fc->final;
-	c->recode = FontencCharsetRecode;
-	c->reverse = FontencCharsetReverse;
 	c->data = fc;
-
-	cacheCharset(c);
-	result = c;
+	if (lazy) {
+	    c->fontenc = fc;
+	    c->recode = LazyCharsetRecode;
+	    c->reverse = LazyCharsetReverse;
+	    result = c;
+	} else if (bindFontencCharset(c, fc)) {
+	    result = c;
+	}
+	if (result != NULL)
+	    cacheCharset(c);
     }
 
     if (result == NULL && c != NULL)
@@ -488,22 +682,22 @@ getCharset(unsigned final, int type)
     if (c)
 	return c;
 
-    c = getFontencCharset(final, type, NULL);
+    c = getFontencCharset(final, type, NULL, 0);
     if (c)
 	return c;
 
     return getUnknownCharset(type);
 }
 
-const CharsetRec *
-getCharsetByName(const char *name)
+static const CharsetRec *
+findCharsetByName(const char *name, int lazy)
 {
     const CharsetRec *c;
     FontEncPtr f;
     int type = T_94;
 
-    VERBOSE(2, ("getCharsetByName(%s)\n", NonNull(name)));
-    TRACE(("getCharsetByName(%s)\n", NonNull(name)));
+    VERBOSE(2, ("getCharsetByName(%s)%s\n", NonNull(name), lazy ? " lazy" : ""));
+    TRACE(("getCharsetByName(%s)%s\n", NonNull(name), lazy ? " lazy" : ""));
 
     if (name == NULL)
 	return getUnknownCharset(type);
@@ -512,7 +706,7 @@ getCharsetByName(const char *name)
     if (c)
 	return c;
 
-    c = getFontencCharset(0, 0, name);
+    c = getFontencCharset(0, 0, name, lazy);
     if (c)
 	return c;
 
@@ -525,13 +719,29 @@ getCharsetByName(const char *name)
      */
     if ((f = lookupOneFontenc(name)) != NULL) {
 	if (addFontencCharset(name, f)) {
-	    c = getFontencCharset(0, 0, name);
+	    c = getFontencCharset(0, 0, name, lazy);
 	    if (c)
 		return c;
 	}
     }
     return getUnknownCharset(type);
 }
+const CharsetRec *
+getCharsetByName(const char *name)
+{
+    return findCharsetByName(name, 0);
+}
+
+/*
+ * Like getCharsetByName, but defer loading the charset's mapping until it is
+ * first used.
+ */
+const CharsetRec *
+getLazyCharsetByName(const char *name)
+{
+    return findCharsetByName(name, 1);
+}
+
 /* *INDENT-OFF* */
 static const LocaleCharsetRec localeCharsets[] =
 {
@@ -807,6 +1017,18 @@ matchLocaleCharset(const char *charset)
     return p;
 }
 
+/*
+ * Charsets which are not invoked into GL or GR are reached only by shifts,
+ * and many sessions never use them.  Defer loading those.
+ */
+static const CharsetRec *
+getLocaleCharset(const LocaleCharsetRec * p, int g, const char *name)
+{
+    return ((g == p->gl || g == p->gr)
+	    ? getCharsetByName(name)
+	    : getLazyCharsetByName(name));
+}
+
 int
 getLocaleState(const char *locale,
 	       const char *charset,
@@ -826,7 +1048,9 @@ getLocaleState(const char *locale,
 	if (ignore_locale) {
 	    charset = locale;
 	} else {
+	    beginPhase("locale.alias");
 	    resolved = resolveLocale(locale);
+	    endPhase();
 	    if (!resolved)
 		return -1;
 	    if ((charset = strrchr(resolved, '.')) != NULL) {
@@ -840,10 +1064,10 @@ getLocaleState(const char *locale,
     if ((p = matchLocaleCharset(charset)) != NULL) {
 	*gl_return = p->gl;
 	*gr_return = p->gr;
-	*g0_return = getCharsetByName(p->g0);
-	*g1_return = getCharsetByName(p->g1);
-	*g2_return = getCharsetByName(p->g2);
-	*g3_return = getCharsetByName(p->g3);
+	*g0_return = getLocaleCharset(p, 0, p->g0);
+	*g1_return = getLocaleCharset(p, 1, p->g1);
+	*g2_return = getLocaleCharset(p, 2, p->g2);
+	*g3_return = getLocaleCharset(p, 3, p->g3);
 	if (p->other)
 	    *other_return = getCharsetByName(p->other);
 	else
@@ -1018,6 +1242,11 @@ destroyCharset(CharsetPtr p)
 	} else {
 	    destroyFontencCharsetPtr((FontencCharsetPtr) p->data);
 	}
+	free(p->utf8);
+	if (p->table != NULL) {
+	    free(p->table->ucs);
+	    free(p->table);
+	}
 	free(p);
     }
 }
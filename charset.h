@@ -44,6 +44,20 @@ typedef enum {
    the first byte */
 #define CHARSET_REGULAR(c) ((c)->type != T_128)
 
+/* Pre-encoded UTF-8 for one byte of an 8-bit charset */
+typedef struct _CharsetUTF8 {
+    unsigned char text[4];
+    unsigned char size;
+} CharsetUTF8;
+
+/* Unicode values for each pair of bytes in a multibyte charset */
+typedef struct _CharsetTable {
+    unsigned first;		/* lowest second byte */
+    unsigned last;		/* highest second byte */
+    unsigned cols;		/* number of second bytes per row */
+    unsigned *ucs;		/* 128 rows of cols entries */
+} CharsetTable;
+
 typedef struct _Charset {
     const char *name;
     int type;
@@ -51,10 +65,13 @@ typedef struct _Charset {
     unsigned int (*recode) (unsigned int, const struct _Charset * self);
     int (*reverse) (unsigned int, const struct _Charset * self);
     const void *data;
+    struct _FontencCharset *fontenc;	/* if non-null, bound on first use */
     int (*other_stack) (unsigned c, OtherStatePtr aux);
     OtherState *other_aux;
     unsigned int (*other_recode) (unsigned int c, OtherStatePtr aux);
     unsigned int (*other_reverse) (unsigned int c, OtherStatePtr aux);
+    CharsetUTF8 *utf8;		/* if non-null, output for each byte 0-255 */
+    CharsetTable *table;	/* if non-null, recode() for multibyte sets */
     struct _Charset *next;
 } CharsetRec, *CharsetPtr;
 
@@ -84,6 +101,7 @@ int lcStrCmp(const char *, const char *);
 const CharsetRec *getUnknownCharset(int);
 const CharsetRec *getCharset(unsigned, int);
 const CharsetRec *getCharsetByName(const char *);
+const CharsetRec *getLazyCharsetByName(const char *);
 const FontencCharsetRec *getFontencByName(const char *);
 const FontencCharsetRec *getCompositePart(const char *, unsigned);
 const char *getCompositeCharset(const char *);
@@ -0,0 +1,95 @@
+#!/bin/sh
+# -----------------------------------------------------------------------------
+# this file is part of luit
+#
+# Copyright 2026 by Thomas E. Dickey
+#
+#                         All Rights Reserved
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+# OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE ABOVE LISTED COPYRIGHT HOLDER(S) BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+# Except as contained in this notice, the name(s) of the above copyright
+# holders shall not be used in advertising or otherwise to promote the
+# sale, use or other dealings in this Software without prior written
+# authorization.
+# -----------------------------------------------------------------------------
+#
+# Convert a few control strings with "luit -c", comparing the result with the
+# expected UTF-8.  Input and output are given as printf formats, with octal
+# escapes for the bytes which are not ASCII.
+#
+# usage: check.sh LUIT
+
+LANG=C;		export LANG
+LC_ALL=C;	export LC_ALL
+
+LUIT=${1:-./luit}
+
+if test ! -x "$LUIT" ; then
+	echo "? not an executable: $LUIT" >&2
+	exit 1
+fi
+
+TMP=`mktemp -d 2>/dev/null || echo /tmp/luit-check$$`
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' 0 1 2 15
+
+FAILED=0
+
+# usage: check ENCODING INPUT EXPECTED DESCRIPTION
+check() {
+	printf "$2" >"$TMP/input"
+	printf "$3" >"$TMP/expect"
+	if "$LUIT" -c -encoding "$1" <"$TMP/input" >"$TMP/actual" 2>"$TMP/errors" \
+	 && cmp -s "$TMP/expect" "$TMP/actual" ; then
+		echo "ok	$1	$4"
+	else
+		echo "FAILED	$1	$4"
+		od -c "$TMP/actual"
+		cat "$TMP/errors"
+		FAILED=`expr $FAILED + 1`
+	fi
+}
+
+# 0x9C is the 8-bit ST in ISO-8859-1, but a lead byte in GBK and GB18030.
+check ISO-8859-1 '\033]0;\351t\351\234x\n' \
+		 '\033]0;\303\251t\303\251\302\234x\n' \
+		 "title ended by 8-bit ST"
+check GBK	 '\033]0;\234@\007x\n' \
+		 '\033]0;\346\267\215\007x\n' \
+		 "multibyte title ended by BEL"
+check GBK	 '\033]2;a\234@b\033\\x\n' \
+		 '\033]2;a\346\267\215b\033\\x\n' \
+		 "multibyte title ended by ESC \\"
+check GB18030	 '\033P\234@q\033\\x\n' \
+		 '\033P\346\267\215q\033\\x\n' \
+		 "multibyte DCS payload"
+check UTF-8	 '\033]0;\346\267\215\007x\n' \
+		 '\033]0;\346\267\215\007x\n' \
+		 "UTF-8 title"
+check ISO-8859-1 '\033Pq#0;2;0;0;0\016#0!5~\033\\x\n' \
+		 '\033Pq#0;2;0;0;0\016#0!5~\033\\x\n' \
+		 "sixels copied as is"
+
+if test $FAILED != 0 ; then
+	echo "? $FAILED check(s) failed" >&2
+	exit 1
+fi
+exit 0
@@ -24,6 +24,7 @@ THE SOFTWARE.
 
 #include <other.h>
 #include <sys.h>
+#include <bench.h>
 
 #ifdef USE_ZLIB
 #include <zlib.h>
@@ -274,6 +275,7 @@ loadEncodingsDir(void)
 	int n, found;
 	int row = 0;
 
+	beginPhase("encodings.dir");
 	if (path == NULL) {
 	    TRACE(("cannot find encodings.dir\n"));
 	} else if ((fp = fopen(path, "r")) == NULL) {
@@ -324,6 +326,7 @@ loadEncodingsDir(void)
 	    }
 	}
 	free(buffer);
+	endPhase();
     }
 }
 
@@ -848,8 +851,10 @@ lookupOneFontenc(const char *name)
 		if (!StrCaseCmp(name, encodings_dir[n].alias)) {
 		    if ((result = encodings_dir[n].data) == NULL
 			&& encodings_dir[n].used == 0) {
+			beginPhase("fontenc");
 			result = loadFontEncRec(encodings_dir[n].alias,
 						encodings_dir[n].path);
+			endPhase();
 			if (result == NULL) {
 			    Warning("cannot load data for %s\n",
 				    encodings_dir[n].path);
@@ -30,6 +30,12 @@ THE SOFTWARE.
 
 #include <sys.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define BUFFERED_INPUT_SIZE 4
 static unsigned char buffered_input[BUFFERED_INPUT_SIZE];
 static int buffered_input_count = 0;
@@ -37,10 +43,17 @@ static int buffered_input_count = 0;
 static void terminateEsc(Iso2022Ptr, int, unsigned char *, unsigned);
 static void terminate(Iso2022Ptr, int);
 
-#define OUTBUF_FREE(is, count) ((is)->outbuf_count + (count) <= BUFFER_SIZE)
+#define OUTBUF_FREE(is, count) ((is)->outbuf_count + (count) <= (is)->outbuf_size)
 #define OUTBUF_MAKE_FREE(is, fd, count) \
     if(!OUTBUF_FREE((is), (count))) outbuf_flush((is), (fd))
 
+/* copyIn() shares the output buffer logic, but is not logged */
+#define INBUF_MAKE_FREE(is, fd, count) \
+    if(!OUTBUF_FREE((is), (count))) outbuf_write((is), (fd))
+
+/* true if -bufsize fixes the size of reads */
+#define PINNED(is) ((is)->read_min == (is)->read_max)
+
 #ifdef OPT_TRACE
 static void
 trace_charset(const char *tag, const CharsetRec * ptr)
@@ -86,33 +99,145 @@ trace_iso2022(const char *tag, const Iso2022Ptr ptr)
 #define trace_iso2022(tag, ptr)	/* nothing */
 #endif
 
-static void
-outbuf_flush(Iso2022Ptr is, int fd)
+/*
+ * Write as much of the data as possible.  If "wait" is set, wait for the
+ * descriptor to accept all of it.  Return the number of bytes written, or -1
+ * on error.
+ */
+static int
+writeBytes(Iso2022Ptr is, int fd, const unsigned char *data, size_t count, int wait)
 {
+    Iso2022Stats *stats = is->stats;
     int rc;
-    unsigned i = 0;
-
-    if (olog >= 0)
-	IGNORE_RC(write(olog, is->outbuf, is->outbuf_count));
-
-    while (i < is->outbuf_count) {
-	rc = (int) write(fd, is->outbuf + i, is->outbuf_count - i);
+    size_t i = 0;
+    int tries = 0;
+
+    while (i < count) {
+	++tries;
+	rc = (int) write(fd, data + i, count - i);
+	TRACE_EVENT(evWRITE, fd, count - i, rc,
+		    ("writeBytes %d:%lu ->%d\n", fd, (unsigned long) (count - i), rc));
+	if (stats != NULL)
+	    stats->writes++;
 	if (rc > 0) {
-	    i += (unsigned) rc;
+	    i += (size_t) rc;
 	} else {
 	    if (rc < 0 && errno == EINTR)
 		continue;
 	    else if ((rc == 0) || ((rc < 0) && (errno == EAGAIN))) {
-		if (waitForOutput(fd) == IO_Closed)
+		if (stats != NULL)
+		    stats->stalls++;
+		PROBE2(stall, fd, count - i);
+		if (!wait)
 		    break;
+		if (stats != NULL) {
+		    double began = getSeconds();
+		    rc = waitForOutput(fd);
+		    stats->blocked += getSeconds() - began;
+		} else {
+		    rc = waitForOutput(fd);
+		}
+		if (rc == IO_Closed)
+		    return -1;
 		continue;
 	    } else
-		break;
+		return -1;
+	}
+    }
+    if (stats != NULL)
+	stats->bytes_written += i;
+    PROBE4(write, fd, count, i, tries);
+    return (int) i;
+}
+
+/*
+ * Append data to the output queue, which is written by flushIso2022().
+ */
+static void
+queueBytes(Iso2022Ptr is, const unsigned char *data, size_t count)
+{
+    if (is->queue_head + is->queue_count + count > is->queue_size) {
+	if (is->queue_count + count <= is->queue_size) {
+	    memmove(is->queue, is->queue + is->queue_head, is->queue_count);
+	} else {
+	    size_t want = is->queue_count + count + QUEUE_SIZE;
+	    unsigned char *grow = malloc(want);
+
+	    if (grow == NULL)
+		FatalError("Couldn't allocate output queue\n");
+	    if (is->queue != NULL) {
+		memcpy(grow, is->queue + is->queue_head, is->queue_count);
+		free(is->queue);
+	    }
+	    is->queue = grow;
+	    is->queue_size = want;
+	}
+	is->queue_head = 0;
+    }
+    memcpy(is->queue + is->queue_head + is->queue_count, data, count);
+    is->queue_count += count;
+}
+
+static void
+outbuf_write(Iso2022Ptr is, int fd)
+{
+    /* a BUFFER_SIZE outbuf would have been written in pieces */
+    if (is->stats != NULL && is->outbuf_count != 0 && !PINNED(is))
+	is->stats->saved += (unsigned long) ((is->outbuf_count - 1) / BUFFER_SIZE);
+    if (is->sink != NULL) {
+	is->sink(is, is->outbuf, is->outbuf_count);
+	if (is->stats != NULL)
+	    is->stats->bytes_written += is->outbuf_count;
+    } else if (is->queued) {
+	const unsigned char *data = is->outbuf;
+	size_t count = is->outbuf_count;
+	int rc;
+
+	/* do not wait, but write directly if nothing is queued */
+	if (is->queue_count == 0
+	    && (rc = writeBytes(is, fd, data, count, 0)) > 0) {
+	    data += rc;
+	    count -= (size_t) rc;
 	}
+	if (count != 0)
+	    queueBytes(is, data, count);
+    } else {
+	IGNORE_RC(writeBytes(is, fd, is->outbuf, is->outbuf_count, 1));
     }
     is->outbuf_count = 0;
 }
 
+/*
+ * Count the characters in UTF-8 text, i.e., the bytes which are not
+ * continuation bytes.
+ */
+static unsigned long
+utf8Chars(const unsigned char *data, size_t count)
+{
+    unsigned long result = 0;
+    size_t n;
+
+    for (n = 0; n < count; ++n) {
+	if ((data[n] & 0xC0) != 0x80)
+	    ++result;
+    }
+    return result;
+}
+
+/* only copyOut() uses this, so the output is UTF-8 */
+static void
+outbuf_flush(Iso2022Ptr is, int fd)
+{
+    if (is->stats != NULL)
+	is->stats->chars += utf8Chars(is->outbuf, is->outbuf_count);
+    PROBE2(flush, fd, is->outbuf_count);
+
+    if (olog >= 0)
+	IGNORE_RC(write(olog, is->outbuf, is->outbuf_count));
+
+    outbuf_write(is, fd);
+}
+
 static void
 outbufOne(Iso2022Ptr is, int fd, unsigned c)
 {
@@ -124,8 +249,11 @@ outbufOne(Iso2022Ptr is, int fd, unsigned c)
 static void
 outbufUTF8(Iso2022Ptr is, int fd, unsigned c)
 {
-    if (c == 0)
+    if (c == 0) {
+	if (is->stats != NULL)
+	    is->stats->unmapped++;
 	return;
+    }
 
     if (c <= 0x7F) {
 	OUTBUF_MAKE_FREE(is, fd, 1);
@@ -166,6 +294,144 @@ outbufUTF8(Iso2022Ptr is, int fd, unsigned c)
     }
 }
 
+/*
+ * Copy a run of bytes which need no conversion, flushing as needed.
+ */
+static void
+outbufRun(Iso2022Ptr is, int fd, const unsigned char *s, size_t count)
+{
+    while (count != 0) {
+	size_t room;
+
+	OUTBUF_MAKE_FREE(is, fd, 1);
+	room = is->outbuf_size - is->outbuf_count;
+	if (room > count)
+	    room = count;
+	memcpy(is->outbuf + is->outbuf_count, s, room);
+	is->outbuf_count += room;
+	s += room;
+	count -= room;
+    }
+}
+
+#define IS_ASCII_TEXT(c) ((c) >= 0x20 && (c) < 0x7F)
+
+/*
+ * Return the length of the leading run of printable ASCII (0x20 to 0x7E) in
+ * the buffer.  None of the control characters which the parser must see (ESC,
+ * SI/SO, SS2/SS3 and CSI) can occur in such a run.
+ */
+static size_t
+asciiSpan(const unsigned char *s, size_t count)
+{
+    size_t n = 0;
+
+#if defined(__AVX2__)
+    const __m256i lo32 = _mm256_set1_epi8(0x1F);
+    const __m256i hi32 = _mm256_set1_epi8(0x7F);
+
+    while (n + 32 <= count) {
+	__m256i data = _mm256_loadu_si256((const __m256i *) (const void *) (s + n));
+	__m256i good = _mm256_and_si256(_mm256_cmpgt_epi8(data, lo32),
+					_mm256_cmpgt_epi8(hi32, data));
+	unsigned mask = (unsigned) _mm256_movemask_epi8(good);
+	if (mask != 0xFFFFFFFFU)
+	    return n + (size_t) __builtin_ctz(~mask);
+	n += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    {
+	const __m128i lo16 = _mm_set1_epi8(0x1F);
+	const __m128i hi16 = _mm_set1_epi8(0x7F);
+
+	while (n + 16 <= count) {
+	    __m128i data = _mm_loadu_si128((const __m128i *) (const void *) (s + n));
+	    /* signed compares, so bytes with the high bit set fail the first */
+	    __m128i good = _mm_and_si128(_mm_cmpgt_epi8(data, lo16),
+					 _mm_cmpgt_epi8(hi16, data));
+	    unsigned mask = (unsigned) _mm_movemask_epi8(good);
+	    if (mask != 0xFFFF)
+		return n + (size_t) __builtin_ctz(~mask);
+	    n += 16;
+	}
+    }
+#endif
+    while (n < count && IS_ASCII_TEXT(s[n]))
+	++n;
+    return n;
+}
+
+/*
+ * Return the length of the leading part of a control string's payload which
+ * can be copied as is.  That stops at ESC (which begins ST, or cancels the
+ * string), at CAN or SUB (which cancel it), and at the 8-bit ST.  Other C1
+ * controls are copied only if GR allows them; otherwise those bytes, like the
+ * rest of the non-ASCII ones, are text to be converted, e.g., the lead byte of
+ * a GBK character.  An OSC string also stops at BEL, which ends it.
+ */
+static size_t
+stringSpan(Iso2022Ptr is, const unsigned char *s, size_t count)
+{
+    int osc = (is->stringType == OSC_7);
+    int c1 = (OTHER(is) == NULL && CHARSET_REGULAR(GR(is)));
+    size_t n = 0;
+
+    while (n < count) {
+	unsigned c;
+
+	n += asciiSpan(s + n, count - n);
+	if (n >= count)
+	    break;
+	c = s[n];
+	if (c == ESC
+	    || c == CAN
+	    || c == SUB
+	    || c == ST
+	    || (c >= 0x80 && (osc || !c1 || c >= 0xA0))
+	    || (osc && c == BEL))
+	    break;
+	++n;
+    }
+    return n;
+}
+
+/*
+ * Check if the current GL charset maps printable ASCII onto itself, caching
+ * the result until GL is changed by a shift or designation.
+ */
+static int
+isAsciiGL(Iso2022Ptr is)
+{
+    const CharsetRec *charset = GL(is);
+
+    if (charset != is->checked_gl) {
+	int result = 0;
+
+	switch (charset->type) {
+	case T_94:
+	case T_96:
+	case T_128:
+	    {
+		unsigned code;
+
+		result = 1;
+		for (code = 0x21; code < 0x7F; ++code) {
+		    if (charset->recode(code, charset) != code) {
+			result = 0;
+			break;
+		    }
+		}
+	    }
+	    break;
+	}
+	TRACE(("isAsciiGL(%s) %d\n", NonNull(charset->name), result));
+	is->checked_gl = charset;
+	is->ascii_gl = result;
+    }
+    return is->ascii_gl;
+}
+
 static void
 buffer(Iso2022Ptr is, unsigned c)
 {
@@ -203,7 +469,7 @@ outbuf_buffered_carefully(Iso2022Ptr is, int fd)
 static void
 outbuf_buffered(Iso2022Ptr is, int fd)
 {
-    if (is->buffered_count > BUFFER_SIZE)
+    if (is->buffered_count > is->outbuf_size)
 	outbuf_buffered_carefully(is, fd);
 
     OUTBUF_MAKE_FREE(is, fd, is->buffered_count);
@@ -229,6 +495,8 @@ allocIso2022(void)
     G0(is) = G1(is) = G2(is) = G3(is) = OTHER(is) = NULL;
 
     is->parserState = P_NORMAL;
+    is->stringType = 0;
+    is->stringText = 0;
     is->shiftState = S_NORMAL;
 
     is->inputFlags = IF_EIGHTBIT | IF_SS | IF_SSGR;
@@ -240,16 +508,410 @@ allocIso2022(void)
 
     is->buffered_ku = -1;
 
-    is->outbuf = malloc((size_t) BUFFER_SIZE);
+    is->checked_gl = NULL;
+    is->ascii_gl = 0;
+
+    is->outbuf_size = OUTBUF_RATIO * BUFFER_SIZE;
+    is->outbuf = malloc(is->outbuf_size);
     if (!is->outbuf) {
 	free(is);
 	return NULL;
     }
     is->outbuf_count = 0;
+    is->read_size = BUFFER_SIZE;
+    is->read_min = BUFFER_SIZE;
+    is->read_max = BUFFER_MAX;
+
+    is->queue = NULL;
+    is->queue_head = 0;
+    is->queue_count = 0;
+    is->queue_size = 0;
+    is->queued = 0;
+    is->sink = NULL;
+    is->stats = NULL;
+
+    is->splice_pipe[0] = is->splice_pipe[1] = -1;
+    is->splice_ilog[0] = is->splice_ilog[1] = -1;
+    is->splice_olog[0] = is->splice_olog[1] = -1;
+    is->splice_write = 1;
 
     return is;
 }
 
+/*
+ * Pin the size of reads (and of the output buffer) for this direction, or if
+ * "size" is zero, let adaptBuffer() choose it.
+ */
+void
+setBufferIso2022(Iso2022Ptr is, size_t size)
+{
+    if (size != 0) {
+	is->read_min = is->read_max = size;
+    } else {
+	is->read_min = BUFFER_SIZE;
+	is->read_max = BUFFER_MAX;
+    }
+    is->read_size = is->read_min;
+}
+
+/*
+ * Return the number of bytes which the next read for this direction should
+ * ask for.
+ */
+size_t
+readSizeIso2022(Iso2022Ptr is)
+{
+    return is->read_size;
+}
+
+/*
+ * Count a read of "count" bytes given to copyIn() or copyOut().  Calls saved
+ * by large buffers are counted only if adaptBuffer() chooses their size.
+ */
+static void
+countRead(Iso2022Ptr is, size_t count)
+{
+    if (is->stats != NULL) {
+	is->stats->reads++;
+	if (count != 0 && !PINNED(is))
+	    is->stats->saved += (unsigned long) ((count - 1) / BUFFER_SIZE);
+    }
+}
+
+/*
+ * Choose the size of the next read after one of "count" bytes.  That doubles
+ * while reads fill the buffer, e.g., for a burst of output, and halves when
+ * they use no more than a quarter of it, i.e., the traffic is interactive.
+ * The output buffer follows, so that the conversion of a whole read is written
+ * at once.  It is empty between reads.
+ */
+static void
+adaptBuffer(Iso2022Ptr is, size_t count)
+{
+    size_t size = is->read_size;
+
+    if (count >= size && size < is->read_max) {
+	size *= 2;
+    } else if (count <= size / 4 && size > is->read_min) {
+	size /= 2;
+    }
+    if (size > is->read_max)
+	size = is->read_max;
+    if (size < is->read_min)
+	size = is->read_min;
+    is->read_size = size;
+
+    size *= OUTBUF_RATIO;
+    if (size != is->outbuf_size && is->outbuf_count == 0) {
+	unsigned char *resize = realloc(is->outbuf, size);
+
+	if (resize != NULL) {
+	    TRACE(("adaptBuffer %lu\n", (unsigned long) is->read_size));
+	    is->outbuf = resize;
+	    is->outbuf_size = size;
+	}
+    }
+}
+
+/*
+ * Start counting activity for this direction.  Return -1 on failure.
+ */
+int
+setStatsIso2022(Iso2022Ptr is)
+{
+    if (is->stats == NULL
+	&& (is->stats = TypeCalloc(Iso2022Stats)) == NULL)
+	return -1;
+    return 0;
+}
+
+/*
+ * Count a sample in the log2 histogram.  getSeconds() uses a monotonic clock
+ * where it can, but if it falls back to the wall clock, a step backward would
+ * give a negative interval, which is discarded.
+ */
+static void
+addLatency(Iso2022Stats * stats, double seconds)
+{
+    double usecs = seconds * 1.0e6;
+    unsigned bucket = 0;
+
+    if (seconds < 0.0)
+	return;
+    while (usecs >= 2.0 && bucket < LATENCY_BUCKETS - 1) {
+	usecs /= 2.0;
+	++bucket;
+    }
+    stats->latency[bucket]++;
+    stats->samples++;
+    if (seconds > stats->latency_max)
+	stats->latency_max = seconds;
+}
+
+/*
+ * Record the latency of the reads whose output has been written.
+ */
+static void
+doneMarks(Iso2022Stats * stats)
+{
+    double now = 0.0;
+
+    while (stats->mark_count != 0
+	   && stats->marks[stats->mark_head].end <= stats->bytes_written) {
+	if (now == 0.0)
+	    now = getSeconds();
+	addLatency(stats, now - stats->marks[stats->mark_head].began);
+	stats->mark_head = (stats->mark_head + 1) % LATENCY_MARKS;
+	stats->mark_count--;
+    }
+}
+
+/*
+ * The data read at "began" has been given to copyIn() or copyOut().  If its
+ * output has been written, record the latency now, otherwise when the output
+ * queue has been written that far.
+ */
+void
+markIso2022(Iso2022Ptr is, double began)
+{
+    Iso2022Stats *stats = is->stats;
+    unsigned long end;
+
+    if (stats == NULL)
+	return;
+
+    end = stats->bytes_written + (unsigned long) is->queue_count;
+    if (is->queue_count == 0) {
+	addLatency(stats, getSeconds() - began);
+    } else if (stats->mark_count < LATENCY_MARKS) {
+	unsigned n = (stats->mark_head + stats->mark_count) % LATENCY_MARKS;
+	stats->marks[n].end = end;
+	stats->marks[n].began = began;
+	stats->mark_count++;
+    } else {
+	/* no room: let the newest mark stand for this read too */
+	unsigned n = (stats->mark_head + LATENCY_MARKS - 1) % LATENCY_MARKS;
+	stats->marks[n].end = end;
+    }
+}
+
+/*
+ * Return the latency in seconds for the given fraction of the reads, e.g.,
+ * 0.99 for the 99th percentile.  This is the upper limit of the histogram
+ * bucket, but no more than the maximum.
+ */
+double
+latencyIso2022(Iso2022Ptr is, double fraction)
+{
+    Iso2022Stats *stats = is->stats;
+    double result = 0.0;
+
+    if (stats != NULL && stats->samples != 0) {
+	double want = fraction * (double) stats->samples;
+	unsigned long total = 0;
+	unsigned n;
+
+	result = stats->latency_max;
+	for (n = 0; n < LATENCY_BUCKETS; ++n) {
+	    total += stats->latency[n];
+	    if ((double) total >= want) {
+		double limit = 2.0 * (double) (1UL << n) / 1.0e6;
+		if (limit < result)
+		    result = limit;
+		break;
+	    }
+	}
+    }
+    return result;
+}
+
+/*
+ * If queued, copyIn() and copyOut() do not wait for their output to be
+ * written, but save what could not be written for flushIso2022().
+ */
+void
+setQueuedIso2022(Iso2022Ptr is, int queued)
+{
+    is->queued = queued;
+}
+
+/*
+ * Return the number of bytes in the output queue.
+ */
+size_t
+pendingIso2022(Iso2022Ptr is)
+{
+    return is->queue_count;
+}
+
+/*
+ * Write the output queue, waiting for it to drain if "wait" is set.  If the
+ * descriptor fails, discard the queue and return -1.
+ */
+int
+flushIso2022(Iso2022Ptr is, int fd, int wait)
+{
+    int rc = 0;
+
+    if (is->queue_count != 0) {
+	rc = writeBytes(is, fd, is->queue + is->queue_head, is->queue_count, wait);
+	if (rc < 0) {
+	    is->queue_count = 0;
+	    if (is->stats != NULL)
+		is->stats->mark_count = 0;
+	} else {
+	    is->queue_head += (size_t) rc;
+	    is->queue_count -= (size_t) rc;
+	    rc = 0;
+	}
+	if (is->queue_count == 0)
+	    is->queue_head = 0;
+	if (is->stats != NULL)
+	    doneMarks(is->stats);
+    }
+    return rc;
+}
+
+/*
+ * Return true if the output can be spliced:  the encoding is UTF-8, and escape
+ * sequences are not interpreted.  Unlike copyOut(), which discards malformed
+ * UTF-8, splicing passes it through, so that is done only for -splice.
+ */
+int
+passthruIso2022(Iso2022Ptr is)
+{
+    return ((is->outputFlags & OF_PASSTHRU) != 0
+	    && OTHER(is) != NULL
+	    && OTHER(is)->other_recode == mapping_utf8);
+}
+
+/*
+ * Write "count" bytes from a pipe to a file, using splice() if the file
+ * allows it.  Return false if they could not all be written.
+ */
+static int
+drainPipe(int from, int fd, size_t count)
+{
+    unsigned char data[BUFFER_SIZE];
+
+    while (count != 0) {
+	int rc = spliceBytes(from, fd, count);
+
+	if (rc <= 0) {
+	    size_t want = (count < sizeof(data)) ? count : sizeof(data);
+	    size_t done = 0;
+
+	    if ((rc = (int) read(from, data, want)) <= 0)
+		return 0;
+	    while (done < (size_t) rc) {
+		int wrote = (int) write(fd, data + done, (size_t) rc - done);
+
+		if (wrote > 0) {
+		    done += (size_t) wrote;
+		} else if (wrote < 0 && errno == EINTR) {
+		    continue;
+		} else {
+		    return 0;
+		}
+	    }
+	}
+	count -= (size_t) rc;
+    }
+    return 1;
+}
+
+/*
+ * Copy the data in the splice pipe to a log file, leaving it in the pipe.
+ * Each log file has its own pipe.  If that cannot be emptied, it is closed,
+ * discarding the rest, so that it does not appear in the next copy.
+ */
+static void
+spliceLog(Iso2022Ptr is, int fd, int *log, size_t count)
+{
+    int rc;
+
+    if (fd < 0
+	|| (log[0] < 0 && pipe(log) < 0))
+	return;
+    if ((rc = teeBytes(is->splice_pipe[0], log[1], count)) > 0
+	&& !drainPipe(log[0], fd, (size_t) rc)) {
+	TRACE(("spliceLog: cannot write log %d\n", fd));
+	close(log[0]);
+	close(log[1]);
+	log[0] = log[1] = -1;
+    }
+}
+
+/*
+ * Forward data from "from" to "fd" without converting it, by splicing it
+ * through a pipe, for passthruIso2022().  The -ilog and -olog files get a
+ * copy using tee().  What the descriptor does not accept goes into the output
+ * queue, as for copyOut().  Return the number of bytes read, like read(), or
+ * -1 with errno set to EINVAL if splice() cannot read from "from".
+ */
+int
+spliceIso2022(Iso2022Ptr is, int fd, int from)
+{
+    Iso2022Stats *stats = is->stats;
+    unsigned char data[BUFFER_SIZE];
+    size_t left;
+    int got;
+
+    if (is->splice_pipe[0] < 0 && pipe(is->splice_pipe) < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    got = spliceBytes(from, is->splice_pipe[1], readSizeIso2022(is));
+    if (got <= 0)
+	return got;
+    adaptBuffer(is, (size_t) got);
+
+    /* the data is not seen, so characters and escapes are not counted */
+    if (stats != NULL) {
+	stats->bytes_read += (unsigned long) got;
+	stats->reads++;
+	stats->spliced = 1;
+    }
+    spliceLog(is, ilog, is->splice_ilog, (size_t) got);
+    spliceLog(is, olog, is->splice_olog, (size_t) got);
+
+    left = (size_t) got;
+    while (left != 0 && is->queue_count == 0 && is->splice_write) {
+	int rc = spliceBytes(is->splice_pipe[0], fd, left);
+
+	TRACE_EVENT(evWRITE, fd, left, rc,
+		    ("spliceIso2022 %d:%lu ->%d\n", fd, (unsigned long) left, rc));
+	if (stats != NULL)
+	    stats->writes++;
+	if (rc > 0) {
+	    left -= (size_t) rc;
+	    if (stats != NULL)
+		stats->bytes_written += (unsigned long) rc;
+	} else {
+	    if (rc < 0 && errno == EAGAIN) {
+		if (stats != NULL)
+		    stats->stalls++;
+		PROBE2(stall, fd, left);
+	    } else if (rc < 0 && errno == EINVAL) {
+		is->splice_write = 0;
+	    }
+	    break;
+	}
+    }
+
+    /* the rest goes through the queue, which flushIso2022() writes */
+    while (left != 0) {
+	size_t want = (left < sizeof(data)) ? left : sizeof(data);
+	int rc = (int) read(is->splice_pipe[0], data, want);
+
+	if (rc <= 0)
+	    break;
+	queueBytes(is, data, (size_t) rc);
+	left -= (size_t) rc;
+    }
+    return got;
+}
+
 #ifdef NO_LEAKS
 void
 destroyIso2022(Iso2022Ptr is)
@@ -258,6 +920,22 @@ destroyIso2022(Iso2022Ptr is)
 	free(is->buffered);
     if (is->outbuf)
 	free(is->outbuf);
+    if (is->queue)
+	free(is->queue);
+    if (is->stats)
+	free(is->stats);
+    if (is->splice_pipe[0] >= 0) {
+	close(is->splice_pipe[0]);
+	close(is->splice_pipe[1]);
+    }
+    if (is->splice_ilog[0] >= 0) {
+	close(is->splice_ilog[0]);
+	close(is->splice_ilog[1]);
+    }
+    if (is->splice_olog[0] >= 0) {
+	close(is->splice_olog[0]);
+	close(is->splice_olog[1]);
+    }
     free(is);
 }
 #endif
@@ -387,9 +1065,22 @@ mergeIso2022(Iso2022Ptr d, Iso2022Ptr s)
     if (d->grp == NULL)
 	d->grp = &(d->g[identifyCharset(s, s->grp)]);
     trace_iso2022("...mergeIso2022", d);
+    PROBE4(merge,
+	   (G0(d) != NULL) ? NonNull(G0(d)->name) : "",
+	   (G1(d) != NULL) ? NonNull(G1(d)->name) : "",
+	   (G2(d) != NULL) ? NonNull(G2(d)->name) : "",
+	   (G3(d) != NULL) ? NonNull(G3(d)->name) : "");
     return 0;
 }
 
+static void
+inbufBytes(Iso2022Ptr is, int fd, const unsigned char *data, size_t count)
+{
+    INBUF_MAKE_FREE(is, fd, count);
+    memcpy(is->outbuf + is->outbuf_count, data, count);
+    is->outbuf_count += count;
+}
+
 static int
 utf8Count(unsigned c)
 {
@@ -435,7 +1126,13 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 {
     unsigned char *c;
     int codepoint, rem;
+    unsigned long chars = 0;
+    unsigned long unmapped = 0;
+    unsigned long escapes = 0;
 
+    PROBE2(copyin_entry, fd, count);
+    countRead(is, (size_t) count);
+    adaptBuffer(is, (size_t) count);
     c = buf;
     rem = count;
 
@@ -464,8 +1161,10 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    } else {
 		codepoint = *c;
 		NEXT;
-		if (codepoint == ESC)
+		if (codepoint == ESC) {
 		    is->parserState = P_ESC;
+		    escapes++;
+		}
 	    }
 	} else if ((*c & 0x40)) {
 	    if (buffered_input_count > 0) {
@@ -488,8 +1187,10 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 		if (buffered_input_count >= utf8Count(buffered_input[0])) {
 		    codepoint = fromUtf8(buffered_input);
 		    buffered_input_count = 0;
-		    if (codepoint == CSI)
+		    if (codepoint == CSI) {
 			is->parserState = P_CSI;
+			escapes++;
+		    }
 		}
 	    }
 	}
@@ -500,21 +1201,23 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    unsigned ucode = (unsigned) codepoint;
 	    unsigned char obuf[4];
 
+	    chars++;
+
 #define WRITE_1(i) do { \
 	    obuf[0] = UChar(i); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 1)); \
+	    inbufBytes(is, fd, obuf, (size_t) 1); \
 	} while(0)
 #define WRITE_2(i) do { \
 	    obuf[0] = UChar(((i) >> 8) & 0xFF); \
 	    obuf[1] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 2)); \
+	    inbufBytes(is, fd, obuf, (size_t) 2); \
 	} while(0)
 
 #define WRITE_3(i) do { \
 	    obuf[0] = UChar(((i) >> 16) & 0xFF); \
 	    obuf[1] = UChar(((i) >>  8) & 0xFF); \
 	    obuf[2] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 3)); \
+	    inbufBytes(is, fd, obuf, (size_t) 3); \
 	} while(0)
 
 #define WRITE_4(i) do { \
@@ -522,20 +1225,20 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[1] = UChar(((i) >> 16) & 0xFF); \
 	    obuf[2] = UChar(((i) >>  8) & 0xFF); \
 	    obuf[3] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 4)); \
+	    inbufBytes(is, fd, obuf, (size_t) 4); \
        } while(0)
 
 #define WRITE_1_P_8bit(p, i) { \
 	    obuf[0] = UChar(p); \
 	    obuf[1] = UChar(i); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 2)); \
+	    inbufBytes(is, fd, obuf, (size_t) 2); \
 	}
 
 #define WRITE_1_P_7bit(p, i) { \
 	    obuf[0] = ESC; \
 	    obuf[1] = UChar((p) - 0x40); \
 	    obuf[2] = UChar(i); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 3)); \
+	    inbufBytes(is, fd, obuf, (size_t) 3); \
 	}
 
 #define WRITE_1_P(p,i) do { \
@@ -548,7 +1251,7 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[0] = UChar(p); \
 	    obuf[1] = UChar(((i) >> 8) & 0xFF); \
 	    obuf[2] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 3)); \
+	    inbufBytes(is, fd, obuf, (size_t) 3); \
 	}
 
 #define WRITE_2_P_7bit(p, i) { \
@@ -556,7 +1259,7 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[1] = UChar((p) - 0x40); \
 	    obuf[2] = UChar(((i) >> 8) & 0xFF); \
 	    obuf[3] = UChar((i) & 0xFF); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 4)); \
+	    inbufBytes(is, fd, obuf, (size_t) 4); \
 	}
 
 #define WRITE_2_P(p,i) do { \
@@ -570,7 +1273,7 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[0] = UChar(p); \
 	    obuf[1] = UChar((i) & 0xFF); \
 	    obuf[2] = UChar(s); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 3)); \
+	    inbufBytes(is, fd, obuf, (size_t) 3); \
 	} while(0)
 
 #define WRITE_2_P_S(p,i,s) do { \
@@ -578,7 +1281,7 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    obuf[1] = UChar(((i) >> 8) & 0xFF); \
 	    obuf[2] = UChar((i) & 0xFF); \
 	    obuf[3] = UChar(s); \
-	    IGNORE_RC(write(fd, obuf, (size_t) 4)); \
+	    inbufBytes(is, fd, obuf, (size_t) 4); \
 	} while(0)
 
 	    if (ucode < 0x20 ||
@@ -599,6 +1302,8 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 		    WRITE_2(c2);
 		else if (c2)
 		    WRITE_1(c2);
+		else
+		    unmapped++;
 		continue;
 	    }
 	    i = (GL(is)->reverse) (ucode, GL(is));
@@ -686,6 +1391,8 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 	    }
 	    if (is->inputFlags & IF_SS) {
 		i = G3(is)->reverse(ucode, G3(is));
+		if (i < 0)
+		    unmapped++;
 		switch (GR(is)->type) {
 		case T_94:
 		case T_96:
@@ -743,6 +1450,7 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 		    continue;
 		}
 	    }
+	    unmapped++;
 #undef WRITE_1
 #undef WRITE_2
 #undef WRITE_1_P
@@ -753,26 +1461,122 @@ copyIn(Iso2022Ptr is, int fd, unsigned char *buf, int count)
 #undef WRITE_2_P_8bit
 	}
     }
+    if (is->stats != NULL) {
+	is->stats->bytes_read += (unsigned long) count;
+	is->stats->chars += chars;
+	is->stats->unmapped += unmapped;
+	is->stats->escapes += escapes;
+    }
+    outbuf_write(is, fd);
+    PROBE2(copyin_return, fd, count);
 }
 
 #define PAIR(a,b) ((unsigned) ((a) << 8) | (b))
 
+/*
+ * Use the compiled table for a multibyte charset if we have one, otherwise
+ * the charset's recode function.
+ */
+static unsigned
+recodePair(const CharsetRec * charset, unsigned ku, unsigned code)
+{
+    const CharsetTable *table = charset->table;
+
+    if (table != NULL
+	&& ku < 0x80
+	&& code >= table->first
+	&& code <= table->last) {
+	return table->ucs[(ku * table->cols) + code - table->first];
+    }
+    return charset->recode(PAIR(ku, code), charset);
+}
+
+/*
+ * Convert a run of complete double-byte characters in GR, stopping at the
+ * first byte which is not part of one.  The first byte of each character is
+ * limited to 0xA0-0xFF, which excludes C1 controls.  Return the number of
+ * bytes used.
+ */
+static size_t
+pairsGR(Iso2022Ptr is, int fd, const unsigned char *s, size_t count)
+{
+    const CharsetRec *charset = GR(is);
+    const CharsetTable *table = charset->table;
+    size_t n = 0;
+
+    while (n + 1 < count && s[n] >= 0xA0) {
+	unsigned ku = (unsigned) (s[n] - 0x80);
+	unsigned code = s[n + 1];
+
+	switch (charset->type) {
+	case T_9494:
+	    if (code < 0xA1 || code > 0xFE)
+		return n;
+	    code -= 0x80;
+	    break;
+	case T_9696:
+	    if (code < 0xA0)
+		return n;
+	    code -= 0x80;
+	    break;
+	case T_94192:
+	    if (!((code >= 0x21 && code <= 0x7E) ||
+		  (code >= 0xA1 && code <= 0xFE)))
+		return n;
+	    break;
+	default:
+	    return n;
+	}
+	outbufUTF8(is, fd, table->ucs[(ku * table->cols) + code - table->first]);
+	n += 2;
+    }
+    return n;
+}
+
 void
 copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 {
     unsigned char *s = buf;
 
+    PROBE2(copyout_entry, fd, count);
+    countRead(is, (size_t) count);
+    adaptBuffer(is, (size_t) count);
     if (ilog >= 0)
 	IGNORE_RC(write(ilog, buf, (size_t) count));
+    if (is->stats != NULL)
+	is->stats->bytes_read += count;
 
     while (s < buf + count) {
 	switch (is->parserState) {
 	case P_NORMAL:
 	  resynch:
+	    /*
+	     * Runs of printable ASCII in an ASCII-compatible GL, and of
+	     * double-byte characters in a compiled GR, need none of the
+	     * per-character processing below.
+	     */
+	    if (is->buffered_ku < 0
+		&& is->shiftState == S_NORMAL
+		&& OTHER(is) == NULL) {
+		size_t run = 0;
+
+		if (IS_ASCII_TEXT(*s) && isAsciiGL(is)) {
+		    run = asciiSpan(s, (size_t) (buf + count - s));
+		    outbufRun(is, fd, s, run);
+		} else if (*s >= 0xA0 && GR(is)->table != NULL) {
+		    run = pairsGR(is, fd, s, (size_t) (buf + count - s));
+		}
+		if (run != 0) {
+		    s += run;
+		    continue;
+		}
+	    }
 	    if (is->buffered_ku < 0) {
 		if (*s == ESC) {
 		    buffer(is, *s++);
 		    is->parserState = P_ESC;
+		    if (is->stats != NULL)
+			is->stats->escapes++;
 		} else if (OTHER(is) != NULL
 			   && OTHER(is)->other_recode != NULL
 			   && OTHER(is)->other_stack != NULL
@@ -788,14 +1592,22 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		} else if (*s == CSI && CHARSET_REGULAR(GR(is))) {
 		    buffer(is, *s++);
 		    is->parserState = P_CSI;
+		    if (is->stats != NULL)
+			is->stats->escapes++;
+		} else if (IS_STRING_C1(*s) && CHARSET_REGULAR(GR(is))) {
+		    is->stringType = *s - 0x40;
+		    outbufUTF8(is, fd, *s++);
+		    is->parserState = P_STRING;
+		    if (is->stats != NULL)
+			is->stats->escapes++;
 		} else if ((*s == SS2 ||
 			    *s == SS3 ||
 			    *s == LS0 ||
 			    *s == LS1) &&
 			   CHARSET_REGULAR(GR(is))) {
+		    /* this may be in the text of an OSC string */
 		    buffer(is, *s++);
 		    terminate(is, fd);
-		    is->parserState = P_NORMAL;
 		} else if (*s <= 0x20 && is->shiftState == S_NORMAL) {
 		    /* Pass through C0 when GL is not regular */
 		    outbufOne(is, fd, *s);
@@ -837,6 +1649,21 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 			code = UChar(*s - 0x80);
 		    }
 
+		    if (charset->utf8 != NULL) {
+			const CharsetUTF8 *p = charset->utf8 + *s;
+
+			if (p->size == 0 && is->stats != NULL)
+			    is->stats->unmapped++;
+			OUTBUF_MAKE_FREE(is, fd, sizeof(p->text));
+			memcpy(is->outbuf + is->outbuf_count,
+			       p->text,
+			       sizeof(p->text));
+			is->outbuf_count += p->size;
+			is->shiftState = S_NORMAL;
+			s++;
+			continue;
+		    }
+
 		    switch (charset->type) {
 		    case T_94:
 			if (code >= 0x21 && code <= 0x7E)
@@ -915,8 +1742,7 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		    break;
 		case T_9494:
 		    if (code >= 0x21 && code <= 0x7E) {
-			outbufUTF8(is, fd,
-				   charset->recode(PAIR(ku_code, code), charset));
+			outbufUTF8(is, fd, recodePair(charset, ku_code, code));
 			is->buffered_ku = -1;
 			is->shiftState = S_NORMAL;
 		    } else {
@@ -928,8 +1754,7 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		    break;
 		case T_9696:
 		    if (code >= 0x20) {
-			outbufUTF8(is, fd,
-				   charset->recode(PAIR(ku_code, code), charset));
+			outbufUTF8(is, fd, recodePair(charset, ku_code, code));
 			is->buffered_ku = -1;
 			is->shiftState = S_NORMAL;
 		    } else {
@@ -943,9 +1768,7 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		    /* Use *s, not code */
 		    if (((*s >= 0x21) && (*s <= 0x7E)) ||
 			((*s >= 0xA1) && (*s <= 0xFE))) {
-			unsigned ucode = PAIR(ku_code, *s);
-			outbufUTF8(is, fd,
-				   charset->recode(ucode, charset));
+			outbufUTF8(is, fd, recodePair(charset, ku_code, *s));
 			is->buffered_ku = -1;
 			is->shiftState = S_NORMAL;
 		    } else {
@@ -966,6 +1789,11 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 	    if (*s == CSI_7) {
 		buffer(is, *s++);
 		is->parserState = P_CSI;
+	    } else if (is->buffered_count == 1 && IS_STRING_ESC(*s)) {
+		is->stringType = *s;
+		buffer(is, *s++);
+		terminate(is, fd);
+		is->parserState = P_STRING;
 	    } else if (IS_FINAL_ESC(*s)) {
 		buffer(is, *s++);
 		terminate(is, fd);
@@ -983,17 +1811,72 @@ copyOut(Iso2022Ptr is, int fd, unsigned char *buf, unsigned count)
 		buffer(is, *s++);
 	    }
 	    break;
+	case P_STRING:
+	    /*
+	     * The payload of a DCS, SOS, OSC, PM or APC string (e.g., sixels,
+	     * or an OSC 52 selection) is copied in bulk, without interpreting
+	     * controls such as SI/SO which it may contain.  Non-ASCII text in
+	     * the payload, e.g., a title, is converted like other text.  For
+	     * an encoding such as GBK, the bytes of a character are given to
+	     * its decoder until it is complete, or a control cuts it short.
+	     */
+	    if (OTHER(is) != NULL
+		&& OTHER(is)->other_recode != NULL
+		&& OTHER(is)->other_stack != NULL
+		&& OTHER(is)->other_aux != NULL
+		&& (is->stringText || *s >= 0x80)) {
+		int c = OTHER(is)->other_stack(*s, OTHER(is)->other_aux);
+
+		is->stringText = (c < 0);
+		if (c != *s || *s >= 0x20) {
+		    if (c >= 0) {
+			unsigned ucode = (unsigned) c;
+			outbufUTF8(is, fd,
+				   OTHER(is)->other_recode(ucode, OTHER(is)->other_aux));
+		    }
+		    s++;
+		    continue;
+		}
+	    }
+	    if (is->buffered_ku < 0) {
+		size_t run = stringSpan(is, s, (size_t) (buf + count - s));
+
+		if (run != 0) {
+		    outbufRun(is, fd, s, run);
+		    s += run;
+		    continue;
+		}
+		if (*s == ESC) {
+		    is->parserState = P_NORMAL;
+		    continue;
+		} else if (*s < 0x80
+			   || (*s == ST
+			       && OTHER(is) == NULL
+			       && CHARSET_REGULAR(GR(is)))) {
+		    /* BEL, CAN, SUB or ST, as UTF-8 like other C1 controls */
+		    outbufUTF8(is, fd, *s++);
+		    is->parserState = P_NORMAL;
+		    continue;
+		}
+	    }
+	    goto resynch;
 	default:
 	    abort();
 	    /* NOTREACHED */
 	}
     }
     outbuf_flush(is, fd);
+    PROBE2(copyout_return, fd, count);
 }
 
 static void
 terminate(Iso2022Ptr is, int fd)
 {
+    PROBE3(terminate,
+	   is->buffered[0],
+	   (is->buffered_count > 1) ? is->buffered[1] : 0,
+	   is->buffered_count);
+
     if (is->outputFlags & OF_PASSTHRU) {
 	outbuf_buffered(is, fd);
 	return;
@@ -1106,12 +1989,14 @@ terminateEsc(Iso2022Ptr is, int fd, unsigned char *s_start, unsigned count)
 		G3(is) = charset;
 		break;
 	    }
+	    PROBE3(designate, s_start[0], s_start[1], NonNull(charset->name));
 	}
 	discard_buffered(is);
     } else if (s_start[0] == 0x24 && count == 2) {
 	if (is->outputFlags & OF_SELECT) {
 	    charset = getCharset(s_start[1], T_9494);
 	    G0(is) = charset;
+	    PROBE3(designate, s_start[0], s_start[1], NonNull(charset->name));
 	}
 	discard_buffered(is);
     } else if (s_start[0] == 0x24 && count >= 2 &&
@@ -1142,6 +2027,7 @@ terminateEsc(Iso2022Ptr is, int fd, unsigned char *s_start, unsigned count)
 		G3(is) = charset;
 		break;
 	    }
+	    PROBE3(designate, s_start[1], s_start[2], NonNull(charset->name));
 	}
 	discard_buffered(is);
     } else
@@ -30,9 +30,23 @@ THE SOFTWARE.
 
 #include <sys/types.h>
 
+#define BEL    0x07
+#define CAN    0x18
+#define SUB    0x1A
 #define ESC    0x1B
 #define CSI    0x9B
 #define CSI_7  '['
+#define DCS    0x90
+#define DCS_7  'P'
+#define SOS    0x98
+#define SOS_7  'X'
+#define ST     0x9C
+#define OSC    0x9D
+#define OSC_7  ']'
+#define PM     0x9E
+#define PM_7   '^'
+#define APC    0x9F
+#define APC_7  '_'
 #define SS2    0x8E
 #define SS2_7  0x4E
 #define SS3    0x8F
@@ -47,10 +61,14 @@ THE SOFTWARE.
 
 #define IS_FINAL_ESC(x) (((x) & 0xF0 ) != 0x20)
 #define IS_FINAL_CSI(x) (((x) & 0xF0 ) != 0x20 && (((x) & 0xF0 ) != 0x30))
+#define IS_STRING_ESC(x) ((x) == DCS_7 || (x) == SOS_7 || (x) == OSC_7 || \
+			  (x) == PM_7 || (x) == APC_7)
+#define IS_STRING_C1(x)  IS_STRING_ESC((x) - 0x40)
 
 #define P_NORMAL    0
 #define P_ESC       1
 #define P_CSI       2
+#define P_STRING    3
 
 #define S_NORMAL    0
 #define S_SS2       1
@@ -66,12 +84,44 @@ THE SOFTWARE.
 #define OF_SELECT   4
 #define OF_PASSTHRU 8
 
+#define LATENCY_BUCKETS 32	/* powers of two, in microseconds */
+#define LATENCY_MARKS   256	/* reads whose output may still be queued */
+
+/*
+ * Counters for one direction, kept if the "stats" pointer is set.
+ */
+typedef struct _Iso2022Stats {
+    unsigned long bytes_read;	/* bytes given to copyIn() or copyOut() */
+    unsigned long bytes_written;	/* bytes accepted by the descriptor */
+    unsigned long chars;	/* characters converted */
+    unsigned long unmapped;	/* characters dropped as unmappable */
+    unsigned long escapes;	/* escape and control sequences seen */
+    unsigned long reads;	/* reads given to copyIn() or copyOut() */
+    unsigned long writes;	/* calls to write() */
+    unsigned long saved;	/* reads and writes saved by large buffers */
+    unsigned long stalls;	/* writes which returned EAGAIN */
+    int spliced;		/* true if data was spliced, not converted */
+    double blocked;		/* seconds waiting for the descriptor */
+    /* delay from reading data to writing its conversion */
+    unsigned long latency[LATENCY_BUCKETS];
+    unsigned long samples;	/* number of reads measured */
+    double latency_max;		/* longest delay, in seconds */
+    struct {
+	unsigned long end;	/* bytes_written when this read is done */
+	double began;		/* when the data was read */
+    } marks[LATENCY_MARKS];
+    unsigned mark_head;		/* index of the oldest mark */
+    unsigned mark_count;	/* number of marks in use */
+} Iso2022Stats;
+
 typedef struct _Iso2022 {
     const CharsetRec **glp;
     const CharsetRec **grp;
     const CharsetRec *g[4];
     const CharsetRec *other;
     int parserState;
+    int stringType;		/* final of the ESC introducing a P_STRING */
+    int stringText;		/* true within a multibyte character there */
     int shiftState;
     int inputFlags;
     int outputFlags;
@@ -81,6 +131,24 @@ typedef struct _Iso2022 {
     int buffered_ku;
     unsigned char *outbuf;
     size_t outbuf_count;
+    size_t outbuf_size;		/* allocated size of outbuf[] */
+    size_t read_size;		/* size for the next read, see adaptBuffer() */
+    size_t read_min;		/* limits for read_size, equal if pinned */
+    size_t read_max;
+    const CharsetRec *checked_gl;	/* GL charset tested for ASCII runs */
+    int ascii_gl;		/* true if checked_gl maps ASCII to itself */
+    unsigned char *queue;	/* output not yet accepted by the descriptor */
+    size_t queue_head;		/* offset of the first byte in queue[] */
+    size_t queue_count;		/* number of bytes in queue[] */
+    size_t queue_size;		/* allocated size of queue[] */
+    int queued;			/* if true, queue output rather than wait */
+    /* if set, this receives the output rather than a file descriptor */
+    void (*sink) (struct _Iso2022 *, const unsigned char *, size_t);
+    Iso2022Stats *stats;	/* if set, count activity for -stats */
+    int splice_pipe[2];		/* pipe used by spliceIso2022(), or -1 */
+    int splice_ilog[2];		/* pipe for copying that to -ilog, or -1 */
+    int splice_olog[2];		/* pipe for copying that to -olog, or -1 */
+    int splice_write;		/* false if splice() cannot write to fd */
 } Iso2022Rec, *Iso2022Ptr;
 
 #define GL(i) (*(i)->glp)
@@ -91,7 +159,12 @@ typedef struct _Iso2022 {
 #define G3(i) ((i)->g[3])
 #define OTHER(i) ((i)->other)
 
-#define BUFFER_SIZE 512
+#define BUFFER_SIZE  512	/* initial size of reads */
+#define BUFFER_MIN   64		/* smallest size for -bufsize */
+#define BUFFER_MAX   (128 * BUFFER_SIZE)	/* largest adaptive size */
+#define BUFFER_LIMIT (2048 * BUFFER_SIZE)	/* largest size for -bufsize */
+#define OUTBUF_RATIO 3		/* UTF-8 bytes per byte read, at most */
+#define QUEUE_SIZE  (64 * BUFFER_SIZE)	/* stop reading when this is queued */
 
 Iso2022Ptr allocIso2022(void);
 int initIso2022(const char *, const char *, Iso2022Ptr);
@@ -99,6 +172,16 @@ int mergeIso2022(Iso2022Ptr, Iso2022Ptr);
 void reportIso2022(const char *, Iso2022Ptr);
 void copyIn(Iso2022Ptr, int, unsigned char *, int);
 void copyOut(Iso2022Ptr, int, unsigned char *, unsigned);
+void setQueuedIso2022(Iso2022Ptr, int);
+size_t pendingIso2022(Iso2022Ptr);
+int flushIso2022(Iso2022Ptr, int, int);
+int setStatsIso2022(Iso2022Ptr);
+void markIso2022(Iso2022Ptr, double);
+double latencyIso2022(Iso2022Ptr, double);
+int passthruIso2022(Iso2022Ptr);
+void setBufferIso2022(Iso2022Ptr, size_t);
+size_t readSizeIso2022(Iso2022Ptr);
+int spliceIso2022(Iso2022Ptr, int, int);
 
 #ifdef NO_LEAKS
 void destroyIso2022(Iso2022Ptr);
@@ -32,10 +32,16 @@ THE SOFTWARE.
 #include <sys/ioctl.h>
 #include <signal.h>
 
+#ifdef HAVE_GETRUSAGE
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
 #include <version.h>
 #include <sys.h>
 #include <parser.h>
 #include <iso2022.h>
+#include <bench.h>
 
 static int pipe_option = 0;
 static int p2c_waitpipe[2];
@@ -47,9 +53,16 @@ static char *child_argv0 = NULL;
 static const char *locale_name = NULL;
 static int exitOnChild = 0;
 static int converter = 0;
+static const char *bench_file = NULL;
+static int bench_input = 0;
 static int testonly = 0;
 static int warnings = 0;
 
+static int stats_fd = -1;	/* -stats or -slog, for reportStats() */
+static double stats_began;	/* when the statistics were started */
+static double stats_idle;	/* seconds waiting for either side */
+static unsigned long stats_waits;	/* number of calls to waitForIO() */
+
 const char *locale_alias = LOCALE_ALIAS_FILE;
 
 int ilog = -1;
@@ -57,6 +70,12 @@ int olog = -1;
 int verbose = 0;
 int ignore_locale = 0;
 int fill_fontenc = 0;
+int iconv_cache = 1;
+int mmap_tables = 0;
+int table_threads = 1;
+
+static size_t buffer_size = 0;	/* -bufsize, or zero to adapt */
+static int splice_option = 0;	/* -splice */
 
 #ifdef USE_ICONV
 UM_MODE lookup_order[] =
@@ -67,6 +86,7 @@ UM_MODE lookup_order[] =
 
 static volatile int sigwinch_queued = 0;
 static volatile int sigchld_queued = 0;
+static volatile int sigusr1_queued = 0;
 
 static int convert(int, int);
 static int condom(int, char **);
@@ -115,7 +135,10 @@ help(const char *program, int fatal)
 	DATA("V", -, "show version"),
 	DATA("alias filename", -, "location of the locale alias file"),
 	DATA("argv0 name", -, "set child's name"),
+	DATA("bench file", -, "replay a captured (-ilog) file, report speed"),
+	DATA("bufsize bytes", -, "use this size for reads rather than adapting"),
 	DATA("c", -, "simple converter stdin/stdout"),
+	DATA("cache", +, "disable on-disk cache of iconv-derived tables"),
 	DATA("encoding encoding", -, "use this encoding rather than current locale's encoding"),
 	DATA("fill-fontenc", -, "fill in one-one mapping in -show-fontenc report"),
 	DATA("g0 set", -, "set output G0 charset (default ASCII)"),
@@ -127,6 +150,7 @@ help(const char *program, int fatal)
 	DATA("h", -, "show this message"),
 	DATA("ilog filename", -, "log all input to this file"),
 	DATA("k7", -, "generate 7-bit characters for input"),
+	DATA("kbench file", -, "replay UTF-8 keyboard input, report speed"),
 	DATA("kg0 set", -, "set input G0 charset"),
 	DATA("kg1 set", -, "set input G1 charset"),
 	DATA("kg2 set", -, "set input G2 charset"),
@@ -140,6 +164,7 @@ help(const char *program, int fatal)
 	DATA("list-builtin", -, "list built-in encodings"),
 	DATA("list-fontenc", -, "list available \".enc\" encoding files"),
 	DATA("list-iconv", -, "list iconv-supported encodings"),
+	DATA("mmap", -, "share cached iconv tables between processes"),
 	DATA("olog filename", -, "log all output to this file"),
 	DATA("ols", +, "disable locking-shifts in output"),
 	DATA("osl", +, "disable charset-selection sequences in output"),
@@ -150,7 +175,15 @@ help(const char *program, int fatal)
 	DATA("show-builtin enc", -, "show details of a given built-in encoding"),
 	DATA("show-fontenc enc", -, "show details of an \".enc\" encoding file"),
 	DATA("show-iconv enc", -, "show iconv encoding in \".enc\" format"),
+#ifdef OPT_TRACE
+	DATA("show-trace file", -, "decode a $LUIT_TRACE ring buffer"),
+#endif
+	DATA("slog filename", -, "like -stats, but write to this file"),
+	DATA("splice", -, "with +ot and UTF-8, splice output without checking it"),
+	DATA("startup-profile", -, "report the time used by each phase of startup"),
+	DATA("stats", -, "report statistics on SIGUSR1 and at exit"),
 	DATA("t", -, "testing (initialize locale but no terminal)"),
+	DATA("threads", +, "build iconv tables in a single thread"),
 	DATA("v", -, "verbose (repeat to increase level)"),
 	DATA("x", -, "exit as soon as child dies"),
 	DATA("-", -, "end of options"),
@@ -327,6 +360,15 @@ parseOptions(int argc, char **argv)
 	} else if (!strcmp(argv[i], "-list")) {
 	    reportCharsets();
 	    ExitSuccess();
+	} else if (!strcmp(argv[i], "+cache")) {
+	    iconv_cache = 0;
+	    i++;
+	} else if (!strcmp(argv[i], "-mmap")) {
+	    mmap_tables = 1;
+	    i++;
+	} else if (!strcmp(argv[i], "+threads")) {
+	    table_threads = 0;
+	    i++;
 	} else if (!strcmp(argv[i], "-fill-fontenc")) {
 	    fill_fontenc = 1;
 	    i++;
@@ -339,6 +381,10 @@ parseOptions(int argc, char **argv)
 	    ExitProgram(showFontencCharset(getParam(i)));
 	} else if (!strcmp(argv[i], "-show-iconv")) {
 	    ExitProgram(showIconvCharset(getParam(i)));
+#ifdef OPT_TRACE
+	} else if (!strcmp(argv[i], "-show-trace")) {
+	    ExitProgram(showTraceRing(getParam(i)));
+#endif
 	} else if (!strcmp(argv[i], "-list-builtin")) {
 	    ExitProgram(reportBuiltinCharsets());
 	} else if (!strcmp(argv[i], "-list-fontenc")) {
@@ -458,6 +504,26 @@ parseOptions(int argc, char **argv)
 	} else if (!strcmp(argv[i], "-c")) {
 	    converter = 1;
 	    i++;
+	} else if (!strcmp(argv[i], "-bench")) {
+	    bench_file = getParam(i);
+	    bench_input = 0;
+	    i += 2;
+	} else if (!strcmp(argv[i], "-bufsize")) {
+	    char *next;
+	    long value = strtol(getParam(i), &next, 0);
+
+	    if (*next != '\0' || value < BUFFER_MIN || value > BUFFER_LIMIT)
+		FatalError("The argument of -bufsize "
+			   "should be a number from %d to %d,\n"
+			   "not %s\n", BUFFER_MIN, BUFFER_LIMIT, argv[i + 1]);
+	    buffer_size = (size_t) value;
+	    setBufferIso2022(outputState, buffer_size);
+	    setBufferIso2022(inputState, buffer_size);
+	    i += 2;
+	} else if (!strcmp(argv[i], "-kbench")) {
+	    bench_file = getParam(i);
+	    bench_input = 1;
+	    i += 2;
 	} else if (!strcmp(argv[i], "-ilog")) {
 	    if (ilog >= 0)
 		close(ilog);
@@ -476,6 +542,25 @@ parseOptions(int argc, char **argv)
 		ExitFailure();
 	    }
 	    i += 2;
+	} else if (!strcmp(argv[i], "-startup-profile")) {
+	    startup_profile = 1;
+	    i++;
+	} else if (!strcmp(argv[i], "-stats")) {
+	    if (stats_fd < 0)
+		stats_fd = STDERR_FILENO;
+	    i++;
+	} else if (!strcmp(argv[i], "-slog")) {
+	    if (stats_fd > STDERR_FILENO)
+		close(stats_fd);
+	    stats_fd = open(getParam(i), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	    if (stats_fd < 0) {
+		perror("Couldn't open statistics log");
+		ExitFailure();
+	    }
+	    i += 2;
+	} else if (!strcmp(argv[i], "-splice")) {
+	    splice_option = 1;
+	    i++;
 	} else if (!strcmp(argv[i], "-alias")) {
 	    locale_alias = getParam(i);
 	    i += 2;
@@ -580,6 +665,8 @@ main(int argc, char **argv)
     int i;
     char *l;
 
+    TRACE_OPEN();
+
 #ifdef HAVE_PUTENV
     if ((l = strmalloc("NCURSES_NO_UTF8_ACS=1")) != NULL)
 	putenv(l);
@@ -618,26 +705,48 @@ main(int argc, char **argv)
     i = parseOptions(argc, argv);
     if (i < 0)
 	FatalError("Couldn't parse options\n");
+    if (testonly && verbose)
+	startup_profile = 1;
 
+    beginPhase("init");
     rc = initIso2022(locale_name, NULL, outputState);
     if (rc < 0)
 	FatalError("Couldn't init output state\n");
 
     rc = mergeIso2022(inputState, outputState);
+    endPhase();
     if (verbose) {
 	reportIso2022("Input", inputState);
     }
     if (rc < 0)
 	FatalError("Couldn't init input state\n");
 
+    if (stats_fd >= 0) {
+	if (setStatsIso2022(outputState) < 0
+	    || setStatsIso2022(inputState) < 0)
+	    FatalError("Couldn't allocate statistics\n");
+	stats_began = getSeconds();
+    }
+
     if (testonly) {
+	reportPhases();
 	if (testonly > 1) {
 	    rc += warnings;
 	}
+    } else if (bench_file != NULL) {
+	if (droppriv() < 0) {
+	    perror("Couldn't drop privileges");
+	    ExitFailure();
+	}
+	rc = benchmark(bench_input ? inputState : outputState,
+		       bench_file, bench_input, locale_name);
+	if (rc < 0)
+	    FatalError("Couldn't run benchmark\n");
     } else {
-	if (converter)
+	if (converter) {
+	    reportPhases();
 	    rc = convert(STDIN_FILENO, STDOUT_FILENO);
-	else
+	} else
 	    rc = condom(argc - i, argv + i);
     }
 
@@ -647,11 +756,135 @@ main(int argc, char **argv)
     return rc;
 }
 
+/*
+ * Write one line of the -stats report, adding a carriage return if the
+ * terminal may be in raw mode.
+ */
+static void
+statsLine(char *buffer)
+{
+    if (isatty(stats_fd))
+	strcat(buffer, "\r");
+    strcat(buffer, "\n");
+    IGNORE_RC(write(stats_fd, buffer, strlen(buffer)));
+}
+
+static void
+statsDirection(const char *tag, Iso2022Ptr is)
+{
+    char buffer[512];
+    const Iso2022Stats *p = is->stats;
+
+    /* spliced data is not examined, so its characters are not counted */
+    sprintf(buffer,
+	    "luit: %s read %lu written %lu",
+	    tag,
+	    p->bytes_read,
+	    p->bytes_written);
+    if (!p->spliced) {
+	sprintf(buffer + strlen(buffer),
+		" chars %lu unmapped %lu escapes %lu",
+		p->chars,
+		p->unmapped,
+		p->escapes);
+    }
+    sprintf(buffer + strlen(buffer),
+	    " reads %lu writes %lu stalls %lu blocked %.3fs pending %lu",
+	    p->reads,
+	    p->writes,
+	    p->stalls,
+	    p->blocked,
+	    (unsigned long) pendingIso2022(is));
+    statsLine(buffer);
+
+    sprintf(buffer,
+	    "luit: %s buffer %lu",
+	    tag,
+	    (unsigned long) readSizeIso2022(is));
+    if (!p->spliced && buffer_size == 0)
+	sprintf(buffer + strlen(buffer), " saved %lu", p->saved);
+    statsLine(buffer);
+
+    sprintf(buffer,
+	    "luit: %s latency samples %lu p50 %.0fus p99 %.0fus"
+	    " p999 %.0fus max %.0fus",
+	    tag,
+	    p->samples,
+	    latencyIso2022(is, 0.50) * 1.0e6,
+	    latencyIso2022(is, 0.99) * 1.0e6,
+	    latencyIso2022(is, 0.999) * 1.0e6,
+	    p->latency_max * 1.0e6);
+    statsLine(buffer);
+}
+
+/*
+ * Report the statistics for -stats.  "Output" is from the child (or stdin
+ * with -c) to the terminal, and "input" from the terminal to the child.
+ */
+static void
+reportStats(const char *when)
+{
+    char buffer[512];
+
+    if (stats_fd < 0)
+	return;
+
+    sprintf(buffer,
+	    "luit: %s pid %ld elapsed %.3fs idle %.3fs waits %lu",
+	    when,
+	    (long) getpid(),
+	    getSeconds() - stats_began,
+	    stats_idle,
+	    stats_waits);
+#ifdef HAVE_GETRUSAGE
+    {
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+	    sprintf(buffer + strlen(buffer),
+		    " user %.3fs system %.3fs",
+		    ((double) usage.ru_utime.tv_sec
+		     + (double) usage.ru_utime.tv_usec / 1.0e6),
+		    ((double) usage.ru_stime.tv_sec
+		     + (double) usage.ru_stime.tv_usec / 1.0e6));
+	}
+    }
+#endif
+    statsLine(buffer);
+    statsDirection("output", outputState);
+    statsDirection("input", inputState);
+}
+
+/*
+ * Account for time spent in waitForIO().  If reading from one side was
+ * stopped because the other side is not accepting output, the time is
+ * counted as blocked for that direction, otherwise as idle.
+ */
+static void
+statsWait(int want, double began)
+{
+    double spent = getSeconds() - began;
+
+    stats_waits++;
+    if (!(want & IO_CanWrite))
+	outputState->stats->blocked += spent;
+    if (!(want & IO_CanRead))
+	inputState->stats->blocked += spent;
+    if ((want & (IO_CanRead | IO_CanWrite)) == (IO_CanRead | IO_CanWrite))
+	stats_idle += spent;
+}
+
+static void
+sigusr1Handler(int sig GCC_UNUSED)
+{
+    sigusr1_queued = 1;
+}
+
 static int
 convert(int ifd, int ofd)
 {
     int rc, i;
-    unsigned char buf[BUFFER_SIZE];
+    unsigned char *buf;
 
     rc = droppriv();
     if (rc < 0) {
@@ -659,17 +892,37 @@ convert(int ifd, int ofd)
 	ExitFailure();
     }
 
+    if (stats_fd >= 0)
+	installHandler(SIGUSR1, sigusr1Handler);
+
+    if ((buf = malloc(buffer_size ? buffer_size : BUFFER_MAX)) == NULL)
+	FatalError("Couldn't allocate read buffer\n");
+
     while (1) {
-	i = (int) read(ifd, buf, (size_t) BUFFER_SIZE);
+	i = (int) read(ifd, buf, readSizeIso2022(outputState));
+	if (sigusr1_queued) {
+	    sigusr1_queued = 0;
+	    reportStats("running");
+	}
 	if (i <= 0) {
 	    if (i < 0) {
+		if (errno == EINTR)
+		    continue;
 		perror("Read error");
 		ExitFailure();
 	    }
 	    break;
 	}
-	copyOut(outputState, ofd, buf, (unsigned) i);
+	if (stats_fd >= 0) {
+	    double began = getSeconds();
+	    copyOut(outputState, ofd, buf, (unsigned) i);
+	    markIso2022(outputState, began);
+	} else {
+	    copyOut(outputState, ofd, buf, (unsigned) i);
+	}
     }
+    free(buf);
+    reportStats("exit");
     return 0;
 }
 
@@ -688,7 +941,7 @@ sigchldHandler(int sig GCC_UNUSED)
 }
 
 static int
-setup_io(int sfd, int pty)
+setup_io(int sfd, int pty, int pid)
 {
     int rc;
     int val;
@@ -698,6 +951,8 @@ setup_io(int sfd, int pty)
     installHandler(SIGWINCH, sigwinchHandler);
 #endif
     installHandler(SIGCHLD, sigchldHandler);
+    if (stats_fd >= 0)
+	installHandler(SIGUSR1, sigusr1Handler);
 
     rc = copyTermios(sfd, pty);
     if (rc < 0)
@@ -718,6 +973,10 @@ setup_io(int sfd, int pty)
 
     setWindowSize(sfd, pty);
 
+    if (setupWaitForIO(sfd, pty, pid) < 0) {
+	TRACE(("...using poll/select in waitForIO\n"));
+    }
+
     return rc;
 }
 
@@ -726,10 +985,13 @@ cleanup_io(int sfd, int pty)
 {
     int val;
 
+    cleanupWaitForIO();
 #ifdef SIGWINCH
     installHandler(SIGWINCH, SIG_DFL);
 #endif
     installHandler(SIGCHLD, SIG_DFL);
+    if (stats_fd >= 0)
+	installHandler(SIGUSR1, SIG_DFL);
 
     val = fcntl(sfd, F_GETFL, 0);
     if (val >= 0) {
@@ -814,11 +1076,15 @@ child(int sfd, char *line, char *path, char *const argv[])
 }
 
 static void
-parent(int sfd, int pty)
+parent(int sfd, int pty, int pid)
 {
-    unsigned char buf[BUFFER_SIZE];
+    unsigned char *buf;
     int i;
     int rc;
+    int splicing = splice_option && passthruIso2022(outputState);
+
+    if ((buf = malloc(buffer_size ? buffer_size : BUFFER_MAX)) == NULL)
+	FatalError("Couldn't allocate read buffer\n");
 
     if (pipe_option) {
 	read_waitpipe(c2p_waitpipe);
@@ -826,22 +1092,62 @@ parent(int sfd, int pty)
 
     if (verbose) {
 	reportIso2022("Output", outputState);
+	if (splicing)
+	    Message("Output is not converted, and is spliced if possible.\n");
     }
-    setup_io(sfd, pty);
+    setup_io(sfd, pty, pid);
 
     if (pipe_option) {
 	write_waitpipe(p2c_waitpipe);
 	close_waitpipe(1);
     }
 
+    /*
+     * Each direction has its own output queue, so that a slow terminal does
+     * not delay input to the child, and vice versa.  Stop reading from either
+     * side when the queue for its output is full.
+     */
+    setQueuedIso2022(outputState, 1);
+    setQueuedIso2022(inputState, 1);
+
     for (;;) {
-	rc = waitForInput(sfd, pty);
+	int want = 0;
+	double began = 0.0;
+
+	if (pendingIso2022(inputState) < QUEUE_SIZE)
+	    want |= IO_CanRead;
+	if (pendingIso2022(outputState) < QUEUE_SIZE)
+	    want |= IO_CanWrite;
+	if (pendingIso2022(outputState) != 0)
+	    want |= IO_OutReady;
+	if (pendingIso2022(inputState) != 0)
+	    want |= IO_InReady;
+
+	if (stats_fd >= 0)
+	    began = getSeconds();
+	rc = waitForIO(sfd, pty, want);
+	TRACE_EVENT(evWAIT, want, rc, 0, ("waitForIO %#x ->%#x\n", want, rc));
+	if (stats_fd >= 0)
+	    statsWait(want, began);
+
+	/* the epoll backend reports signals in the return value */
+	if (rc > 0) {
+	    if (rc & IO_WinSize)
+		sigwinch_queued = 1;
+	    if (rc & IO_ChildExit)
+		sigchld_queued = 1;
+	}
 
 	if (sigwinch_queued) {
 	    sigwinch_queued = 0;
 	    setWindowSize(sfd, pty);
 	}
 
+	if (sigusr1_queued) {
+	    sigusr1_queued = 0;
+	    reportStats("running");
+	}
+
 	if (sigchld_queued && exitOnChild)
 	    break;
 
@@ -849,25 +1155,59 @@ parent(int sfd, int pty)
 	    if (rc & IO_Closed) {
 		break;
 	    }
+	    if (rc & IO_OutReady) {
+		(void) flushIso2022(outputState, sfd, 0);
+	    }
+	    if (rc & IO_InReady) {
+		(void) flushIso2022(inputState, pty, 0);
+	    }
 	    if (rc & IO_CanWrite) {
-		i = (int) read(pty, buf, (size_t) BUFFER_SIZE);
+		if (splicing) {
+		    if (stats_fd >= 0)
+			began = getSeconds();
+		    i = spliceIso2022(outputState, sfd, pty);
+		    if (i < 0 && errno == EINVAL) {
+			TRACE(("...cannot splice from pty, using read\n"));
+			splicing = 0;
+		    }
+		}
+		if (!splicing)
+		    i = (int) read(pty, buf, readSizeIso2022(outputState));
+		TRACE_EVENT(evREAD, pty, i, 0, ("read %d ->%d\n", pty, i));
 		if ((i == 0) || ((i < 0) && (errno != EAGAIN)))
 		    break;
-		if (i > 0)
-		    copyOut(outputState, sfd, buf, (unsigned) i);
+		if (i > 0) {
+		    if (!splicing) {
+			if (stats_fd >= 0)
+			    began = getSeconds();
+			copyOut(outputState, sfd, buf, (unsigned) i);
+		    }
+		    markIso2022(outputState, began);
+		}
 	    }
 	    if (rc & IO_CanRead) {
-		i = (int) read(sfd, buf, (size_t) BUFFER_SIZE);
+		i = (int) read(sfd, buf, readSizeIso2022(inputState));
+		TRACE_EVENT(evREAD, sfd, i, 0, ("read %d ->%d\n", sfd, i));
 		if ((i == 0) || ((i < 0) && (errno != EAGAIN)))
 		    break;
-		if (i > 0)
+		if (i > 0) {
+		    if (stats_fd >= 0)
+			began = getSeconds();
 		    copyIn(inputState, pty, buf, i);
+		    markIso2022(inputState, began);
+		}
 	    }
 	}
     }
 
+    /* the child's output is complete; wait for the terminal to accept it */
+    (void) flushIso2022(outputState, sfd, 1);
+    (void) flushIso2022(inputState, pty, 0);
+
     restoreTermios(sfd);
     cleanup_io(sfd, pty);
+    free(buf);
+    reportStats("exit");
 }
 
 static int
@@ -886,7 +1226,9 @@ condom(int argc, char **argv)
     if (rc < 0)
 	FatalError("Couldn't parse arguments\n");
 
+    beginPhase("pty");
     rc = allocatePty(&pty, &line);
+    endPhase();
     if (rc < 0) {
 	perror("Couldn't allocate pty");
 	ExitFailure();
@@ -903,6 +1245,8 @@ condom(int argc, char **argv)
 	IGNORE_RC(pipe(c2p_waitpipe));
     }
 
+    reportPhases();
+
     TRACE(("...forking to run %s(%s)\n", NonNull(path), NonNull(child_argv[0])));
     pid = fork();
     if (pid < 0) {
@@ -923,7 +1267,7 @@ condom(int argc, char **argv)
 	free(child_argv);
 	free(path);
 	free(line);
-	parent(sfd, pty);
+	parent(sfd, pty, pid);
     }
 
     return 0;
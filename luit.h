@@ -50,6 +50,9 @@ THE SOFTWARE.
 
 extern const char *locale_alias;
 extern int fill_fontenc;
+extern int iconv_cache;
+extern int mmap_tables;
+extern int table_threads;
 extern int ignore_locale;
 extern int iso2022;
 extern int sevenbit;
@@ -25,6 +25,26 @@ THE SOFTWARE.
 #include <iso2022.h>
 
 #include <sys.h>
+#include <version.h>
+#include <bench.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define USE_MMAP 1
+#include <sys/mman.h>
+#endif
+
+#if defined(__GLIBC__) && !defined(_LIBICONV_VERSION)
+#include <gnu/libc-version.h>
+#endif
 
 #ifdef HAVE_LANGINFO_CODESET
 #include <locale.h>
@@ -199,19 +219,63 @@ ConvToUTF8(UCHAR * target, UINT source, size_t limit)
 
 /******************************************************************************/
 
+/*
+ * The forward table and reverse-index are allocated together, with rev_index[]
+ * following table_utf8[], so that a single free() releases both.
+ */
 static LuitConv *
 newLuitConv(size_t elts)
 {
     LuitConv *result = TypeCalloc(LuitConv);
     if (result != NULL) {
+	size_t each = sizeof(MappingData) + sizeof(ReverseData);
+	void *arena = calloc(elts ? elts : 1, each);
+
 	TRACE(("newLuitConv(%u)\n", (unsigned) elts));
-	result->table_size = elts;
-	result->table_utf8 = TypeCallocN(MappingData, elts);
-	result->rev_index = TypeCallocN(ReverseData, elts);
+	if (arena != NULL) {
+	    result->table_size = elts;
+	    result->table_utf8 = (MappingData *) arena;
+	    result->rev_index = (ReverseData *) (void *) (result->table_utf8 + elts);
+	}
+    }
+    return result;
+}
+
+/*
+ * Append a UTF-8 string to the table's text pool, returning its offset.  The
+ * pool may move as it grows, so the strings are addressed by offset.  Offset
+ * zero is reserved to mean that there is no string.
+ */
+static size_t
+addPoolText(LuitConv * data, const void *text, size_t size)
+{
+    size_t result = 0;
+    size_t need = data->text_used + size + 1;
+
+    if (data->text_used == 0)
+	need += 1;
+    if (need > data->text_size) {
+	size_t want = data->text_size ? data->text_size : 1024;
+	char *grow;
+
+	while (want < need)
+	    want *= 2;
+	if ((grow = realloc(data->text_pool, want)) == NULL)
+	    return 0;
+	data->text_pool = grow;
+	data->text_size = want;
     }
+    if (data->text_used == 0)
+	data->text_pool[data->text_used++] = '\0';
+    result = data->text_used;
+    memcpy(data->text_pool + result, text, size);
+    data->text_pool[result + size] = '\0';
+    data->text_used += size + 1;
     return result;
 }
 
+#define PoolText(data, n) ((data)->text_pool + (data)->table_utf8[n].text)
+
 /*
  * Try to open a conversion from UTF-8 to the given encoding name.  This is
  * iconv(), and different implementations expect different syntax for the
@@ -362,7 +426,7 @@ trace_convert(LuitConv * data, size_t which, unsigned gs)
 	   data->table_utf8[which].ucs));
     if (data->table_utf8[which].size) {
 	for (j = 0; j < data->table_utf8[which].size; ++j) {
-	    TRACE(("%c", data->table_utf8[which].text[j]));
+	    TRACE(("%c", PoolText(data, which)[j]));
 	}
     }
     TRACE(("\n"));
@@ -392,8 +456,8 @@ count8bitIconv(iconv_t my_desc)
 
 	input[0] = (char) n;
 	input[1] = 0;
-	(void) iconv(my_desc, NULL, NULL, NULL, NULL);
-	converted = iconv(my_desc, &ip, &in_bytes, &op, &out_bytes);
+	(void) ICONV(my_desc, NULL, NULL, NULL, NULL);
+	converted = ICONV(my_desc, &ip, &in_bytes, &op, &out_bytes);
 	if (converted != (size_t) (-1)) {
 	    ++result;
 	}
@@ -410,26 +474,46 @@ count8bitIconv(iconv_t my_desc)
  *
  * iconv() provides no function for this purpose.  For demonstration purposes
  * (though it is claimed to be slow...) we can use iconv to convert a series
- * of UTF-8 codes to the given encoding, checking if any of those give more
- * than one byte.
+ * of UTF-8 codes to the given encoding, counting the codes which convert.
+ * More than 256 means that it is not a single-byte encoding.
  *
  * If we knew this was always ISO-2022 encoding, we could shorten the scan;
  * however luit does handle a few which are not.
  *
  * As a quick check, we first count the number of codes going _to_ UTF-8 in the
  * series 0..255, and if that is 256 there is no need for this function.
+ * Encodings whose size is known from their name (see knownSingleByte) are
+ * not scanned at all.
  *
- * FIXME: improve this by constructing a table of known single-byte encoding
- * names.
+ * The scan starts with the blocks which multibyte encodings fill densely, so
+ * that those are recognized after a few hundred codes.  Only single-byte
+ * encodings which are not in the registry need the complete scan.
  */
 static unsigned
 sizeofIconvTable(const char *encoding_name, unsigned limit)
 {
+    /* *INDENT-OFF* */
+    static const struct {
+	unsigned first;
+	unsigned last;
+    } order[] = {
+	{ 0x4E00, 0x9FFF },	/* CJK unified ideographs */
+	{ 0xAC00, 0xD7A3 },	/* Hangul syllables */
+	{ 0x3000, 0x30FF },	/* CJK punctuation, kana */
+	{ 0x0000, 0x2FFF },
+	{ 0x3100, 0x4DFF },
+	{ 0xA000, 0xABFF },
+	{ 0xD7A4, 0xFFFF },
+    };
+    /* *INDENT-ON* */
+
     unsigned result = MAX8;
     iconv_t my_desc = iconv_open(encoding_name, "UTF-8");
     if (my_desc != NO_ICONV) {
+	size_t k;
 	unsigned n;
 	unsigned total = 0;
+	int done = 0;
 	size_t in_bytes;
 	UCHAR input[80];
 	ICONV_CONST char *ip;
@@ -439,25 +523,30 @@ sizeofIconvTable(const char *encoding_name, unsigned limit)
 
 	TRACE(("sizeofIconvTable(%s, %u) opened...\n",
 	       NonNull(encoding_name), limit));
-	for (n = 0; n < MAX16; ++n) {
-	    if (!legalUCode(n))
-		continue;
-	    if ((in_bytes = (size_t) ConvToUTF8(input, n, sizeof(input))) == 0) {
-		continue;
-	    }
-	    ip = (ICONV_CONST char *) input;
-	    op = output;
-	    input[in_bytes] = 0;
-	    out_bytes = sizeof(output);
-	    (void) iconv(my_desc, NULL, NULL, NULL, NULL);
-	    if (iconv(my_desc, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1) {
-		continue;
-	    }
-	    ++total;
-	    /* if we have found all codes that the fast check could, quit */
-	    if ((limit == 256) && (total >= limit)) {
-		result = limit;
-		break;
+	for (k = 0; k < SizeOf(order) && !done; ++k) {
+	    for (n = order[k].first; n <= order[k].last && !done; ++n) {
+		if (!legalUCode(n))
+		    continue;
+		if ((in_bytes = (size_t) ConvToUTF8(input, n, sizeof(input))) == 0) {
+		    continue;
+		}
+		ip = (ICONV_CONST char *) input;
+		op = output;
+		input[in_bytes] = 0;
+		out_bytes = sizeof(output);
+		(void) ICONV(my_desc, NULL, NULL, NULL, NULL);
+		if (ICONV(my_desc, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1) {
+		    continue;
+		}
+		++total;
+		if (total > 256) {
+		    /* more codes than a single-byte encoding can hold */
+		    done = 1;
+		} else if ((limit == 256) && (total >= limit)) {
+		    /* if we have found all codes that the fast check could, quit */
+		    result = limit;
+		    done = 1;
+		}
 	    }
 	}
 	iconv_close(my_desc);
@@ -492,22 +581,21 @@ initialize8bitTable(LuitConv * data)
 
 	input[0] = (char) n;
 	input[1] = 0;
-	(void) iconv(data->iconv_desc, NULL, NULL, NULL, NULL);
-	converted = iconv(data->iconv_desc, &ip, &in_bytes, &op, &out_bytes);
+	(void) ICONV(data->iconv_desc, NULL, NULL, NULL, NULL);
+	converted = ICONV(data->iconv_desc, &ip, &in_bytes, &op, &out_bytes);
 	if (converted == (size_t) (-1)) {
 	    TRACE(("convert err %d\n", n));
 	} else {
 	    output[sizeof(output) - out_bytes] = 0;
 	    data->table_utf8[n].size = sizeof(output) - out_bytes;
-	    data->table_utf8[n].text = malloc(data->table_utf8[n].size);
-	    memcpy(data->table_utf8[n].text,
-		   output,
-		   data->table_utf8[n].size);
+	    data->table_utf8[n].text = addPoolText(data,
+						   output,
+						   data->table_utf8[n].size);
 	    if (ConvToUTF32((UINT *) 0,
-			    data->table_utf8[n].text,
+			    output,
 			    data->table_utf8[n].size)) {
 		ConvToUTF32(&(data->table_utf8[n].ucs),
-			    data->table_utf8[n].text,
+			    output,
 			    data->table_utf8[n].size);
 	    }
 	    trace_convert(data, (size_t) n, 0);
@@ -562,6 +650,22 @@ dbcsDecode(const char *buffer, int length, int euc, unsigned *gs)
     return result;
 }
 
+/*
+ * Select the table for a code decoded by dbcsDecode(), or null if none.
+ */
+static LuitConv *
+selectTable(LuitConv ** datap, unsigned gmax, unsigned gs)
+{
+    LuitConv *data;
+
+    if (gs >= gmax) {
+	data = (gs == 1) ? datap[0] : NULL;
+    } else {
+	data = datap[gs];
+    }
+    return data;
+}
+
 /*
  * Build forward/reverse mappings for multi-byte encoding.
  *
@@ -569,23 +673,20 @@ dbcsDecode(const char *buffer, int length, int euc, unsigned *gs)
  * to the target.  That gives us the reverse-mapping information, from which
  * we later construct the forward-mapping.
  *
+ * This is slow, since it converts every Unicode value in the BMP, but works
+ * for any encoding that iconv can produce.
+ *
  * TODO: update charset size as needed for -show-iconv
  */
 static void
-initialize16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
+scan16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
 {
     unsigned n;
     unsigned gs;
     LuitConv *data;
     iconv_t my_desc = iconv_open(charset, "UTF-8");
 
-    TRACE(("initialize16bitTable(%s) gmax %d\n", NonNull(charset), gmax));
-
-    for (n = 0; n < gmax; ++n) {
-	if (datap[n] != NULL) {
-	    datap[n]->len_index = 0;
-	}
-    }
+    TRACE(("scan16bitTable(%s) gmax %d\n", NonNull(charset), gmax));
 
     if (my_desc != NO_ICONV) {
 	int euc = !isOtherCharset(charset);
@@ -609,24 +710,22 @@ initialize16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
 	    op = output;
 	    input[in_bytes] = 0;
 	    out_bytes = sizeof(output);
-	    (void) iconv(my_desc, NULL, NULL, NULL, NULL);
-	    if (iconv(my_desc, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1) {
+	    (void) ICONV(my_desc, NULL, NULL, NULL, NULL);
+	    if (ICONV(my_desc, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1) {
 		continue;
 	    }
 	    my_code = dbcsDecode(output, (int) (op - output), euc, &gs);
-	    if (gs >= gmax) {
-		data = (gs == 1) ? datap[0] : NULL;
-	    } else {
-		data = datap[gs];
-	    }
+	    data = selectTable(datap, gmax, gs);
 	    if ((data == NULL)
 		|| (my_code >= data->table_size)
-		|| data->table_utf8[my_code].text != NULL) {
+		|| data->table_utf8[my_code].text != 0) {
 		TRACE(("skip %d:%#x\n", gs, my_code));
 		continue;
 	    }
 	    data->table_utf8[my_code].size = strlen((char *) input);
-	    data->table_utf8[my_code].text = strmalloc((char *) input);
+	    data->table_utf8[my_code].text = addPoolText(data,
+							 input,
+							 data->table_utf8[my_code].size);
 	    data->table_utf8[my_code].ucs = n;
 
 	    trace_convert(data, (size_t) my_code, gs);
@@ -639,15 +738,549 @@ initialize16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
     }
 }
 
+#define WALK_CELLS	512	/* code cells converted in one batch */
+#define WALK_WIDTH	3	/* longest cell, with its single-shift */
+#define WALK_JOBS	4	/* most threads used to convert the cells */
+#define WALK_SHARE	(8 * WALK_CELLS)	/* fewest cells for a thread */
+#define NO_UCS		(~0U)
+
+typedef struct {
+    UCHAR cell[WALK_WIDTH];
+    UCHAR width;
+    unsigned ucs;		/* decoded value, or NO_UCS */
+    int round;			/* true if ucs encodes back to the cell */
+} WalkCell;
+
+/*
+ * A job converts a slice of the cells with its own iconv descriptors, so that
+ * jobs can run in separate threads.  A job writes only to its own slice, and
+ * counts its iconv calls separately, adding them to the total when done.
+ */
+typedef struct {
+    iconv_t decode;		/* from the charset to UTF-8 */
+    iconv_t encode;		/* from UTF-8 to the charset */
+    WalkCell *cells;
+    size_t count;
+    unsigned long calls;
+#ifdef USE_PTHREADS
+    pthread_t thread;
+    int started;
+#endif
+    char input[WALK_CELLS * (WALK_WIDTH + 2)];
+    char output[WALK_CELLS * (WALK_WIDTH + 2) * 4];
+} WalkJob;
+
+typedef struct {
+    LuitConv **datap;
+    unsigned gmax;
+    int euc;
+    int failed;			/* true if the list could not be allocated */
+    WalkCell *cells;		/* all cells, in the order they are stored */
+    size_t count;
+    size_t stored;		/* number of non-ASCII cells stored */
+} WalkState;
+
+#define JobIconv(job,cd,ip,il,op,ol) (++(job)->calls, iconv(cd, ip, il, op, ol))
+
+/*
+ * Convert lines of text with iconv, replacing each line which cannot be
+ * converted by an empty line, so that the lines of output correspond to the
+ * lines of input.  Return the length of the output.
+ */
+static size_t
+convertLines(WalkJob * job, iconv_t my_desc, size_t length)
+{
+    char *input = job->input;
+    char *output = job->output;
+    ICONV_CONST char *ip = input;
+    size_t in_bytes = length;
+    char *op = output;
+    size_t out_bytes = sizeof(job->output);
+
+    (void) JobIconv(job, my_desc, NULL, NULL, NULL, NULL);
+    while (in_bytes != 0
+	   && JobIconv(job, my_desc, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1) {
+	size_t used = (size_t) (ip - input);
+	char *eol = memchr(input + used, '\n', in_bytes);
+
+	if (eol == NULL || out_bytes == 0)
+	    break;
+	/* discard the partial line, and skip the rest of it */
+	while (op != output && op[-1] != '\n') {
+	    --op;
+	    ++out_bytes;
+	}
+	*op++ = '\n';
+	--out_bytes;
+	in_bytes = length - (size_t) (eol + 1 - input);
+	ip = eol + 1;
+	(void) JobIconv(job, my_desc, NULL, NULL, NULL, NULL);
+    }
+    return (size_t) (op - output);
+}
+
+/*
+ * Find the next line of the output from convertLines(), returning its length,
+ * or -1 if there is none.
+ */
+static int
+nextLine(const char **line, const char *limit, const char **next)
+{
+    int result = -1;
+
+    if (*line < limit) {
+	const char *eol = memchr(*line, '\n', (size_t) (limit - *line));
+	if (eol != NULL) {
+	    result = (int) (eol - *line);
+	    *next = eol + 1;
+	}
+    }
+    return result;
+}
+
+/*
+ * Store a decoded cell in the table selected by its single-shift, unless that
+ * code is already mapped.  Only cells which the encoding produces for their
+ * Unicode value go into the reverse-index.
+ */
+static void
+storeCell(WalkState * w, const WalkCell * c)
+{
+    UCHAR input[80];
+    unsigned my_code;
+    unsigned gs;
+    int length;
+    LuitConv *data;
+
+    my_code = dbcsDecode((const char *) c->cell, (int) c->width, w->euc, &gs);
+    data = selectTable(w->datap, w->gmax, gs);
+    if ((data == NULL)
+	|| (my_code >= data->table_size)
+	|| data->table_utf8[my_code].text != 0
+	|| (length = ConvToUTF8(input, c->ucs, sizeof(input) - 1)) == 0) {
+	TRACE(("skip %d:%#x\n", gs, my_code));
+	return;
+    }
+    input[length] = 0;
+    data->table_utf8[my_code].size = strlen((char *) input);
+    data->table_utf8[my_code].text = addPoolText(data,
+						 input,
+						 data->table_utf8[my_code].size);
+    data->table_utf8[my_code].ucs = c->ucs;
+
+    trace_convert(data, (size_t) my_code, gs);
+    if (my_code >= 0x80 || gs != 0)
+	w->stored++;
+
+    if (c->round) {
+	data->rev_index[data->len_index].ucs = c->ucs;
+	data->rev_index[data->len_index].ch = my_code;
+	data->len_index++;
+    }
+}
+
+/*
+ * Decode a batch of cells, and check which of those encode back to the same
+ * cell.
+ */
+static void
+walkBatch(WalkJob * job, WalkCell * cells, size_t count)
+{
+    const char *line;
+    const char *next;
+    const char *limit;
+    size_t length = 0;
+    size_t n;
+    int size;
+
+    for (n = 0; n < count; ++n) {
+	memcpy(job->input + length, cells[n].cell, (size_t) cells[n].width);
+	length += cells[n].width;
+	job->input[length++] = '\n';
+	cells[n].ucs = NO_UCS;
+	cells[n].round = 0;
+    }
+    length = convertLines(job, job->decode, length);
+
+    /* accept only cells which decode to a single Unicode value in the BMP */
+    line = job->output;
+    limit = job->output + length;
+    for (n = 0; n < count && (size = nextLine(&line, limit, &next)) >= 0; ++n) {
+	unsigned ucs;
+
+	if (size != 0
+	    && ConvToUTF32(&ucs, line, (size_t) size) == size
+	    && ucs < MAX16
+	    && legalUCode(ucs)) {
+	    cells[n].ucs = ucs;
+	}
+	line = next;
+    }
+
+    length = 0;
+    for (n = 0; n < count; ++n) {
+	if (cells[n].ucs != NO_UCS) {
+	    length += (size_t) ConvToUTF8((UCHAR *) job->input + length,
+					  cells[n].ucs,
+					  (size_t) 8);
+	    job->input[length++] = '\n';
+	}
+    }
+    length = convertLines(job, job->encode, length);
+
+    line = job->output;
+    limit = job->output + length;
+    for (n = 0; n < count; ++n) {
+	if (cells[n].ucs == NO_UCS)
+	    continue;
+	if ((size = nextLine(&line, limit, &next)) < 0)
+	    break;
+	cells[n].round = ((unsigned) size == cells[n].width
+			  && !memcmp(line, cells[n].cell, (size_t) size));
+	line = next;
+    }
+}
+
+/*
+ * Convert the job's slice of cells, a batch at a time.
+ */
+static void
+walkSlice(WalkJob * job)
+{
+    size_t n;
+
+    for (n = 0; n < job->count; n += WALK_CELLS) {
+	size_t count = job->count - n;
+
+	if (count > WALK_CELLS)
+	    count = WALK_CELLS;
+	walkBatch(job, job->cells + n, count);
+    }
+}
+
+#ifdef USE_PTHREADS
+static void *
+walkThread(void *arg)
+{
+    walkSlice((WalkJob *) arg);
+    return NULL;
+}
+#endif
+
+/*
+ * Run the jobs, the first in this thread and the others in threads of their
+ * own if possible.  The threads block all signals, leaving those to the main
+ * thread.  A job whose thread cannot be started runs here instead.
+ */
+static void
+runJobs(WalkJob * jobs, size_t njobs)
+{
+    size_t n;
+
+#ifdef USE_PTHREADS
+    if (njobs > 1) {
+	sigset_t all_signals;
+	sigset_t old_signals;
+
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	for (n = 1; n < njobs; ++n) {
+	    jobs[n].started = !pthread_create(&(jobs[n].thread),
+					      NULL,
+					      walkThread,
+					      jobs + n);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    }
+#endif
+    walkSlice(jobs);
+    for (n = 1; n < njobs; ++n) {
+#ifdef USE_PTHREADS
+	if (jobs[n].started) {
+	    pthread_join(jobs[n].thread, NULL);
+	    continue;
+	}
+#endif
+	walkSlice(jobs + n);
+    }
+}
+
+/*
+ * Return the number of jobs to use for converting the cells:  one unless
+ * there are enough cells to make threads worthwhile, and more than one
+ * processor to run them.
+ */
+static size_t
+walkJobs(size_t count)
+{
+    size_t result = 1;
+
+#if defined(USE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+    if (table_threads) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	result = count / WALK_SHARE;
+	if (cpus > 0 && result > (size_t) cpus)
+	    result = (size_t) cpus;
+	if (result > WALK_JOBS)
+	    result = WALK_JOBS;
+	if (result < 1)
+	    result = 1;
+    }
+#else
+    (void) count;
+#endif
+    return result;
+}
+
+/*
+ * Append a cell to the list, which has room for it.
+ */
+static void
+addCell(WalkState * w, int prefix, unsigned first, unsigned second)
+{
+    WalkCell *c = w->cells + w->count++;
+    unsigned width = 0;
+
+    if (prefix)
+	c->cell[width++] = UChar(prefix);
+    c->cell[width++] = UChar(first);
+    if (second)
+	c->cell[width++] = UChar(second);
+    c->width = UChar(width);
+}
+
+/*
+ * Add the cells for one part of the encoding to the list: the single-shift
+ * (if any), and the range of the first byte and of the second (if any).
+ */
+static void
+addCells(WalkState * w, int prefix,
+	 unsigned lo1, unsigned hi1,
+	 unsigned lo2, unsigned hi2)
+{
+    size_t want = (size_t) (hi1 + 1 - lo1) * (lo2 ? (hi2 + 1 - lo2) : 1);
+    WalkCell *grow;
+    unsigned b1, b2;
+
+    TRACE(("...walk %#x: %#x-%#x %#x-%#x\n", prefix, lo1, hi1, lo2, hi2));
+    if (w->failed
+	|| (grow = realloc(w->cells, (w->count + want) * sizeof(WalkCell))) == NULL) {
+	w->failed = 1;
+	return;
+    }
+    w->cells = grow;
+    for (b1 = lo1; b1 <= hi1; ++b1) {
+	if (lo2 == 0) {
+	    addCell(w, prefix, b1, 0);
+	} else {
+	    for (b2 = lo2; b2 <= hi2; ++b2)
+		addCell(w, prefix, b1, b2);
+	}
+    }
+}
+
+/*
+ * Single bytes are converted one at a time, since a newline cannot be both a
+ * cell and the separator between cells.  Return the number which decode.
+ */
+static unsigned
+walkBytes(WalkState * w, WalkJob * job)
+{
+    unsigned n;
+    unsigned result = 0;
+
+    for (n = 0; n < MAX8; ++n) {
+	char input[4];
+	ICONV_CONST char *ip = input;
+	char output[80];
+	char *op = output;
+	size_t in_bytes = 1;
+	size_t out_bytes = sizeof(output);
+	WalkCell cell;
+
+	input[0] = (char) n;
+	(void) ICONV(job->decode, NULL, NULL, NULL, NULL);
+	/* flush a letter which the decoder holds for a combining mark */
+	if (ICONV(job->decode, &ip, &in_bytes, &op, &out_bytes) == (size_t) -1
+	    || ICONV(job->decode, NULL, NULL, &op, &out_bytes) == (size_t) -1
+	    || op == output
+	    || ConvToUTF32(&cell.ucs, output, (size_t) (op - output)) != (op - output)
+	    || cell.ucs >= MAX16
+	    || !legalUCode(cell.ucs)) {
+	    continue;
+	}
+	cell.cell[0] = UChar(n);
+	cell.width = 1;
+
+	ip = output;
+	in_bytes = (size_t) (op - output);
+	op = job->output;
+	out_bytes = sizeof(job->output);
+	(void) ICONV(job->encode, NULL, NULL, NULL, NULL);
+	cell.round = (ICONV(job->encode, &ip, &in_bytes,
+			    &op, &out_bytes) != (size_t) -1
+		      && op == job->output + 1
+		      && UChar(job->output[0]) == n);
+	storeCell(w, &cell);
+	++result;
+    }
+    return result;
+}
+
+/*
+ * Build forward/reverse mappings for multi-byte encoding, by walking its code
+ * cells rather than the whole BMP.  The cells are converted to UTF-8 in
+ * batches, separated by newlines.  The layout of a composite (EUC) encoding
+ * is given by its parts in datap[]:  G1 uses the bytes with the high bit set,
+ * G2 and G3 are reached by SS2 and SS3, and a part whose table is MAX8 uses
+ * one byte rather than two.  A single table may be for an encoding such as
+ * Shift-JIS, so it uses a lead byte with the high bit set, followed by a
+ * second byte from a wide range.
+ *
+ * The list of cells may be divided into slices converted by separate threads.
+ * The slices are whole batches, and the results are stored in the order of
+ * the list after all are done, so the tables do not depend on the threads.
+ *
+ * Return false if iconv cannot convert in both directions, or if no single
+ * byte decodes, or nothing beyond ASCII does, e.g., for a stateful encoding
+ * such as ISO-2022-JP or UTF-7.
+ */
+static int
+walk16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
+{
+    WalkState w;
+    WalkJob *jobs;
+    size_t njobs;
+    size_t opened;
+    size_t slice;
+    size_t n;
+    unsigned g;
+    int result = 0;
+
+    TRACE(("walk16bitTable(%s) gmax %d\n", NonNull(charset), gmax));
+
+    memset(&w, 0, sizeof(w));
+    w.datap = datap;
+    w.gmax = gmax;
+    w.euc = !isOtherCharset(charset);
+
+    TRACE(("...assume %s index\n", w.euc ? "EUC" : "non-EUC"));
+    if (gmax > 1) {
+	addCells(&w, 0, 0xA0, 0xFF, 0xA0, 0xFF);
+	for (g = 2; g < gmax; ++g) {
+	    int prefix = (g == 2) ? SS2 : SS3;
+
+	    if (datap[g] == NULL)
+		continue;
+	    if (datap[g]->table_size <= MAX8)
+		addCells(&w, prefix, 0xA0, 0xFF, 0, 0);
+	    else
+		addCells(&w, prefix, 0xA0, 0xFF, 0xA0, 0xFF);
+	}
+    } else {
+	addCells(&w, 0, 0x81, 0xFE, 0x30, 0xFE);
+    }
+
+    njobs = walkJobs(w.count);
+    if (!w.failed && (jobs = TypeCallocN(WalkJob, njobs)) != NULL) {
+	for (opened = 0; opened < njobs; ++opened) {
+	    WalkJob *job = jobs + opened;
+
+	    job->decode = iconv_open("UTF-8", charset);
+	    job->encode = iconv_open(charset, "UTF-8");
+	    if (job->decode == NO_ICONV || job->encode == NO_ICONV) {
+		if (job->decode != NO_ICONV)
+		    iconv_close(job->decode);
+		if (job->encode != NO_ICONV)
+		    iconv_close(job->encode);
+		break;
+	    }
+	}
+
+	if (opened != 0) {
+	    njobs = opened;
+	    TRACE(("...%lu cells, %lu jobs\n", (unsigned long) w.count,
+		   (unsigned long) njobs));
+
+	    slice = (w.count + WALK_CELLS - 1) / WALK_CELLS;
+	    slice = WALK_CELLS * ((slice + njobs - 1) / njobs);
+	    for (n = 0; n < njobs; ++n) {
+		size_t first = n * slice;
+
+		if (first < w.count) {
+		    jobs[n].cells = w.cells + first;
+		    jobs[n].count = w.count - first;
+		    if (jobs[n].count > slice)
+			jobs[n].count = slice;
+		}
+	    }
+
+	    if (walkBytes(&w, jobs) != 0) {
+		runJobs(jobs, njobs);
+		for (n = 0; n < w.count; ++n) {
+		    if (w.cells[n].ucs != NO_UCS)
+			storeCell(&w, w.cells + n);
+		}
+		result = (w.stored != 0);
+	    }
+	    TRACE(("...stored %lu non-ASCII cells\n", (unsigned long) w.stored));
+	}
+
+	for (n = 0; n < opened; ++n) {
+	    iconv_calls += jobs[n].calls;
+	    iconv_close(jobs[n].decode);
+	    iconv_close(jobs[n].encode);
+	}
+	free(jobs);
+    }
+    free(w.cells);
+    return result;
+}
+
+/*
+ * Build forward/reverse mappings for multi-byte encoding.
+ */
+static void
+initialize16bitTable(const char *charset, LuitConv ** datap, unsigned gmax)
+{
+    unsigned n;
+
+    TRACE(("initialize16bitTable(%s) gmax %d\n", NonNull(charset), gmax));
+
+    for (n = 0; n < gmax; ++n) {
+	if (datap[n] != NULL) {
+	    datap[n]->len_index = 0;
+	}
+    }
+
+    if (!walk16bitTable(charset, datap, gmax)) {
+	/* discard whatever the walk stored, e.g., ASCII */
+	for (n = 0; n < gmax; ++n) {
+	    if (datap[n] != NULL) {
+		memset(datap[n]->table_utf8, 0,
+		       datap[n]->table_size * sizeof(datap[n]->table_utf8[0]));
+		datap[n]->len_index = 0;
+		datap[n]->text_used = 0;
+	    }
+	}
+	scan16bitTable(charset, datap, gmax);
+    }
+}
+
 static unsigned
 luitReverse(unsigned code, void *client_data GCC_UNUSED)
 {
     unsigned result = code;
     LuitConv *data = (LuitConv *) client_data;
 
-    TRACE(("luitReverse 0x%04X %p\n", code, (void *) data));
+    if (data != NULL && data->rev_pages != NULL) {
+	size_t row = (size_t) (code >> 8);
 
-    if (data != NULL) {
+	if (row < data->rev_rows && data->rev_pages[row] != NULL) {
+	    result = data->rev_pages[row][code & 0xff];
+	}
+    } else if (data != NULL) {
 	static const ReverseData zero_key;
 	ReverseData *p;
 	ReverseData key = zero_key;
@@ -661,9 +1294,10 @@ luitReverse(unsigned code, void *client_data GCC_UNUSED)
 
 	if (p != NULL) {
 	    result = p->ch;
-	    TRACE(("...mapped %#x\n", result));
 	}
     }
+    TRACE_EVENT(evLUITREVERSE, code, result, 0,
+		("luitReverse 0x%04X %p ->%#x\n", code, (void *) data, result));
     return result;
 }
 
@@ -749,9 +1383,8 @@ initializeBuiltInTable(LuitConv * data,
 	    if ((need = (size_t) ConvToUTF8(buffer,
 					    data->table_utf8[j].ucs,
 					    sizeof(buffer) - 1)) != 0) {
-		data->table_utf8[j].text = malloc(need + 1);
+		data->table_utf8[j].text = addPoolText(data, buffer, need);
 		data->table_utf8[j].size = need;
-		memcpy(data->table_utf8[j].text, buffer, need);
 	    }
 
 	    trace_convert(data, j, 0);
@@ -769,13 +1402,118 @@ findBuiltinEncoding(const char *encoding_name)
     size_t n;
     const BuiltInCharsetRec *result = NULL;
 
-    for (n = 0; builtin_encodings[n].name != NULL; ++n) {
-	if (!lcStrCmp(encoding_name, builtin_encodings[n].name)) {
-	    result = &(builtin_encodings[n]);
+    for (n = 0; builtin_encodings[n].name != NULL; ++n) {
+	if (!lcStrCmp(encoding_name, builtin_encodings[n].name)) {
+	    result = &(builtin_encodings[n]);
+	    break;
+	}
+    }
+
+    return result;
+}
+
+/*
+ * Return the table size needed for a built-in charset.
+ */
+static size_t
+builtinLength(const BuiltInCharsetRec * builtIn)
+{
+    size_t result = MAX8;
+
+    if (builtIn->length != 0) {
+	size_t n;
+	for (n = 0; n < builtIn->length; ++n) {
+	    if (builtIn->table[n].source >= MAX8) {
+		result = MAX16;
+		break;
+	    }
+	}
+    } else {
+	result = MAX16;
+    }
+    return result;
+}
+
+/*
+ * Check if the encoding belongs to a family known to use single bytes, so
+ * that we need not ask iconv.  Names are compared without case or
+ * punctuation.  CP1255 and CP1258 are not listed:  their decoders may hold
+ * back a base letter until they see whether a combining mark follows, which
+ * the 8-bit table builder does not allow for.
+ */
+static int
+knownSingleByte(const char *encoding_name)
+{
+    /* *INDENT-OFF* */
+    static const struct {
+	const char *name;
+	int prefix;		/* true if the name is a family prefix */
+    } table[] = {
+	{ "ansix3.41968",	0 },
+	{ "armscii8",		0 },
+	{ "ascii",		0 },
+	{ "cp1250",		0 },
+	{ "cp1251",		0 },
+	{ "cp1252",		0 },
+	{ "cp1253",		0 },
+	{ "cp1254",		0 },
+	{ "cp1256",		0 },
+	{ "cp1257",		0 },
+	{ "cp437",		0 },
+	{ "cp737",		0 },
+	{ "cp775",		0 },
+	{ "cp85",		1 },	/* cp850 to cp858 */
+	{ "cp86",		1 },	/* cp860 to cp869 */
+	{ "georgian",		1 },
+	{ "ibm437",		0 },
+	{ "ibm85",		1 },
+	{ "ibm86",		1 },
+	{ "iso8859",		1 },
+	{ "koi8",		1 },
+	{ "latin",		1 },
+	{ "pt154",		0 },
+	{ "rk1048",		0 },
+	{ "tis620",		1 },
+	{ "usascii",		0 },
+	{ "viscii",		0 },
+	{ "windows1250",	0 },
+	{ "windows1251",	0 },
+	{ "windows1252",	0 },
+	{ "windows1253",	0 },
+	{ "windows1254",	0 },
+	{ "windows1256",	0 },
+	{ "windows1257",	0 },
+    };
+    /* *INDENT-ON* */
+
+    char key[80];
+    const BuiltInCharsetRec *builtIn;
+    const char *s;
+    size_t len = 0;
+    size_t n;
+    int result = 0;
+
+    for (s = encoding_name; *s != '\0' && len + 1 < sizeof(key); ++s) {
+	if (!isspace(UChar(*s)) && strchr("-_/", *s) == NULL)
+	    key[len++] = (char) tolower(UChar(*s));
+    }
+    key[len] = '\0';
+
+    for (n = 0; n < SizeOf(table); ++n) {
+	size_t want = strlen(table[n].name);
+	if (table[n].prefix
+	    ? !strncmp(key, table[n].name, want)
+	    : !strcmp(key, table[n].name)) {
+	    result = 1;
 	    break;
 	}
     }
-
+    if (!result
+	&& (builtIn = findBuiltinEncoding(encoding_name)) != NULL
+	&& builtinLength(builtIn) == MAX8) {
+	result = 1;
+    }
+    TRACE(("knownSingleByte(%s) %d\n", NonNull(encoding_name), result));
     return result;
 }
 
@@ -783,12 +1521,11 @@ findBuiltinEncoding(const char *encoding_name)
 LuitConv *
 luitLookupEncoding(FontMapPtr mapping)
 {
-    LuitConv *latest;
     LuitConv *result = NULL;
-    for (latest = all_conversions; latest != NULL; latest = latest->next) {
-	if (&(latest->mapping) == mapping) {
-	    result = latest;
-	}
+    if (mapping != NULL
+	&& mapping->conv != NULL
+	&& &(mapping->conv->mapping) == mapping) {
+	result = mapping->conv;
     }
     return result;
 }
@@ -824,11 +1561,12 @@ luitGetFontEnc(const char *name, UM_MODE mode)
 	*mp2 = *mp;
 	mp2->client_data = mq;
 	mp2->next = NULL;
+	mp2->conv = NULL;
 
 	mq->len = (unsigned) lc->table_size;
 	mq->map = map;
 
-	for (n = 0; n < (int) lc->table_size; ++n) {
+	for (n = 0; n < (int) lc->len_index; ++n) {
 	    unsigned ch = lc->rev_index[n].ch;
 	    if (ch < mq->len) {
 		map[ch] = (UCode) lc->rev_index[n].ucs;
@@ -878,12 +1616,86 @@ luitFreeFontEnc(FontEncPtr data)
     }
 }
 
+/*
+ * Build a two-level table from the reverse-index, using the high bits of
+ * the Unicode value to select a page of 256 entries.  Only pages which have
+ * some mapping are allocated, in a single block.  Unmapped entries in a page
+ * hold the Unicode value itself, which is what luitReverse() returns if there
+ * is no mapping.
+ */
+static void
+initializeReversePages(LuitConv * data)
+{
+    size_t n;
+    size_t row;
+    size_t pages = 0;
+    unsigned max_ucs = 0;
+
+    if (data->len_index == 0)
+	return;
+
+    for (n = 0; n < data->len_index; ++n) {
+	if (data->rev_index[n].ucs > max_ucs)
+	    max_ucs = data->rev_index[n].ucs;
+    }
+
+    data->rev_rows = (size_t) (max_ucs >> 8) + 1;
+    if ((data->rev_pages = TypeCallocN(unsigned *, data->rev_rows)) == NULL) {
+	data->rev_rows = 0;
+	return;
+    }
+
+    /* mark the rows which are used, to allocate their pages together */
+    for (n = 0; n < data->len_index; ++n) {
+	row = (size_t) (data->rev_index[n].ucs >> 8);
+	if (data->rev_pages[row] == NULL) {
+	    data->rev_pages[row] = &max_ucs;
+	    ++pages;
+	}
+    }
+    if ((data->page_pool = TypeCallocN(unsigned, pages * 256)) == NULL) {
+	free(data->rev_pages);
+	data->rev_pages = NULL;
+	data->rev_rows = 0;
+	return;
+    }
+    for (row = 0, pages = 0; row < data->rev_rows; ++row) {
+	if (data->rev_pages[row] != NULL) {
+	    unsigned *page = data->page_pool + (pages++ * 256);
+	    unsigned col;
+
+	    for (col = 0; col < 256; ++col)
+		page[col] = (unsigned) (row << 8) | col;
+	    data->rev_pages[row] = page;
+	}
+    }
+
+    /*
+     * Go backward, so that if several entries have the same Unicode value,
+     * the one at the lowest index of the sorted rev_index[] is used.
+     */
+    for (n = data->len_index; n-- != 0;) {
+	unsigned ucs = data->rev_index[n].ucs;
+
+	data->rev_pages[ucs >> 8][ucs & 0xff] = data->rev_index[n].ch;
+    }
+}
+
 static void
 finishIconvTable(LuitConv * latest)
 {
+    /* the text pool is complete, give back the unused part */
+    if (latest->text_pool != NULL && latest->text_used < latest->text_size) {
+	char *trim = realloc(latest->text_pool, latest->text_used);
+	if (trim != NULL) {
+	    latest->text_pool = trim;
+	    latest->text_size = latest->text_used;
+	}
+    }
     latest->next = all_conversions;
     latest->mapping.type = FONT_ENCODING_UNICODE;
     latest->mapping.recode = luitRecode;
+    latest->mapping.conv = latest;
     latest->reverse.reverse = luitReverse;
     latest->reverse.data = latest;
     all_conversions = latest;
@@ -911,27 +1723,23 @@ initLuitConv(const char *encoding_name,
 	break;
     default:
 	if (builtIn) {
-	    if (builtIn->length != 0) {
-		size_t n;
-		for (n = 0; n < builtIn->length; ++n) {
-		    if (builtIn->table[n].source >= MAX8) {
-			length = MAX16;
-			break;
-		    }
-		}
-	    } else {
-		length = MAX16;
-	    }
+	    length = builtinLength(builtIn);
+	} else if (knownSingleByte(encoding_name)) {
+	    length = MAX8;
 	} else if ((fast = count8bitIconv(my_desc)) < 256) {
+	    beginPhase("iconv.size");
 	    length = sizeofIconvTable(encoding_name, fast);
+	    endPhase();
 	}
 	break;
     }
 
     TRACE(("initLuitConv(%s) %u\n", NonNull(encoding_name), (unsigned) length));
+    PROBE2(table_entry, NonNull(encoding_name), length);
     if ((latest = newLuitConv(length)) != NULL) {
 	latest->encoding_name = strmalloc(encoding_name);
 	latest->iconv_desc = my_desc;
+	beginPhase("iconv.table");
 	if (builtIn != NULL) {
 	    initializeBuiltInTable(latest, builtIn, enc_file);
 	} else if (length == MAX16) {
@@ -939,16 +1747,19 @@ initLuitConv(const char *encoding_name,
 	} else {
 	    initialize8bitTable(latest);
 	}
+	endPhase();
 	finishIconvTable(latest);
 	result = &(latest->mapping);
 
-	/* sort the reverse-index, to allow using bsearch */
+	/* sort the reverse-index, for reporting and the page-table */
 	if (result != NULL) {
 	    qsort(latest->rev_index,
 		  latest->len_index,
 		  sizeof(latest->rev_index[0]),
 		  cmp_rindex);
+	    initializeReversePages(latest);
 	}
+	PROBE3(table_return, NonNull(encoding_name), length, latest->len_index);
     }
     return result;
 }
@@ -1003,6 +1814,661 @@ convertFontEnc(FontEncPtr fontenc)
     return result;
 }
 
+/******************************************************************************/
+/*
+ * Building the tables for a multibyte encoding takes tens of thousands of
+ * calls to iconv.  Save the result in a binary file under $XDG_CACHE_HOME, so
+ * that later sessions can load the tables without probing iconv.  A file in
+ * LUIT_CACHE_DIR, which an administrator may fill, is preferred to that.
+ *
+ * The file is a sequence of native-endian 32-bit values, addressed by byte
+ * offsets from the beginning of the file, so that it can be used in place
+ * with mmap.  It begins with a header (see CACHE_HEADER), followed by the key
+ * (luit version, iconv implementation, encoding name and size) and an entry
+ * for each table (see CACHE_ENTRY) giving the offsets of
+ *	ucs[table_size]		forward mapping
+ *	text[table_size]	UTF-8 text, as (offset << 8) | size, or 0
+ *	rev_index[len_index]	reverse-index, as ReverseData
+ *	pages[rev_rows]		offset of each page of the reverse-index, or 0
+ * The last value is a checksum of the preceding data.
+ *
+ * A file which does not match in every respect is ignored, and rewritten
+ * after the tables are rebuilt.
+ */
+#ifndef LUIT_CACHE_DIR
+#define LUIT_CACHE_DIR	"/var/cache/luit"	/* read-only, system-wide */
+#endif
+
+#define CACHE_MAGIC	0x5449554c	/* "LUIT" */
+#define CACHE_FORMAT	3		/* change this when the tables change */
+#define CACHE_ORDER	0x01020304
+#define CACHE_LIMIT	(16 * 1024 * 1024)	/* offsets in text[] are 24-bits */
+
+#define CACHE_HEADER	8
+#define hMagic		0
+#define hFormat		1
+#define hOrder		2
+#define hLength		3
+#define hKeyOffset	4
+#define hKeyLength	5
+#define hTables		6
+#define hEntries	7
+
+#define CACHE_ENTRY	9
+#define eNameOffset	0
+#define eNameLength	1
+#define eTableSize	2
+#define eIndexSize	3
+#define eUcsOffset	4
+#define eTextOffset	5
+#define eIndexOffset	6
+#define ePageRows	7
+#define ePageOffset	8
+
+#define CacheItem(n)	((n) * sizeof(UINT))
+
+typedef struct {
+    UCHAR *data;
+    size_t used;
+    size_t size;
+    int failed;
+} CacheBuffer;
+
+static unsigned
+cacheChecksum(const UCHAR * data, size_t length)
+{
+    unsigned result = 2166136261U;	/* FNV-1a */
+    size_t n;
+
+    for (n = 0; n < length; ++n) {
+	result ^= data[n];
+	result *= 16777619U;
+    }
+    return result & 0xffffffffU;
+}
+
+static const char *
+iconvIdentity(void)
+{
+    static char result[80];
+
+    if (result[0] == '\0') {
+#if defined(_LIBICONV_VERSION)
+	sprintf(result, "libiconv %d.%d",
+		(_LIBICONV_VERSION >> 8) & 0xff,
+		_LIBICONV_VERSION & 0xff);
+#elif defined(__GLIBC__)
+	sprintf(result, "glibc %.60s", gnu_get_libc_version());
+#else
+	strcpy(result, "iconv");
+#endif
+    }
+    return result;
+}
+
+/*
+ * The key is stored in the file; the filename is only a hint.
+ */
+static char *
+cacheKey(const char *encoding_name, unsigned tag)
+{
+    const char *ident = iconvIdentity();
+    size_t need = (strlen(LUIT_VERSION)
+		   + strlen(ident)
+		   + strlen(encoding_name)
+		   + 40);
+    char *result = malloc(need);
+
+    if (result != NULL) {
+	sprintf(result, "luit %s\n%s\n%s\n%u",
+		LUIT_VERSION, ident, encoding_name, tag);
+    }
+    return result;
+}
+
+/*
+ * The cache is not used by a setuid/setgid program.
+ */
+static int
+useCache(void)
+{
+    return (iconv_cache
+	    && getuid() == geteuid()
+	    && getgid() == getegid());
+}
+
+/*
+ * Return the name of the cache file for the given encoding in "dir".
+ */
+static char *
+cacheFile(const char *dir, const char *encoding_name, unsigned tag)
+{
+    char *result;
+    char *s;
+    size_t need = strlen(dir) + strlen(encoding_name) + 40;
+
+    if ((result = malloc(need)) != NULL) {
+	sprintf(result, "%s/", dir);
+	s = result + strlen(result);
+	while (*encoding_name != '\0') {
+	    int ch = UChar(*encoding_name++);
+	    *s++ = (char) ((isalnum(ch) || ch == '-' || ch == '_') ? ch : '_');
+	}
+	sprintf(s, ".%u", tag);
+    }
+    return result;
+}
+
+/*
+ * Return the name of the cache file for the given encoding in the system-wide
+ * directory.  luit only reads that; an administrator fills it, so that the
+ * processes of every user can share one copy of the tables with -mmap.
+ */
+static char *
+systemCachePath(const char *encoding_name, unsigned tag)
+{
+    if (!useCache() || *LUIT_CACHE_DIR == '\0')
+	return NULL;
+    return cacheFile(LUIT_CACHE_DIR, encoding_name, tag);
+}
+
+/*
+ * Return the name of the user's cache file for the given encoding, creating
+ * the directory if needed.
+ */
+static char *
+cachePath(const char *encoding_name, unsigned tag)
+{
+    const char *home = getenv("XDG_CACHE_HOME");
+    const char *suffix = "/luit";
+    char *result = NULL;
+    char *dir;
+    char *s;
+
+    if (!useCache())
+	return NULL;
+
+    if (IsEmpty(home) || *home != '/') {
+	home = getenv("HOME");
+	suffix = "/.cache/luit";
+	if (IsEmpty(home) || *home != '/')
+	    return NULL;
+    }
+
+    if ((dir = malloc(strlen(home) + strlen(suffix) + 1)) != NULL) {
+	sprintf(dir, "%s%s", home, suffix);
+	if (!strcmp(suffix, "/.cache/luit")) {
+	    s = strrchr(dir, '/');
+	    *s = '\0';
+	    (void) mkdir(dir, 0700);
+	    *s = '/';
+	}
+	(void) mkdir(dir, 0700);
+	result = cacheFile(dir, encoding_name, tag);
+	free(dir);
+    }
+    return result;
+}
+
+/*
+ * Append data to the buffer, padded to a 32-bit boundary.  Return its offset.
+ */
+static size_t
+putCacheBytes(CacheBuffer * buffer, const void *data, size_t length)
+{
+    size_t result = buffer->used;
+    size_t padded = (length + sizeof(UINT) - 1) & ~(sizeof(UINT) - 1);
+
+    if (buffer->failed)
+	return 0;
+    if (buffer->used + padded > buffer->size) {
+	size_t want = (buffer->size + padded) * 2;
+	UCHAR *grow = realloc(buffer->data, want);
+	if (grow == NULL) {
+	    buffer->failed = 1;
+	    return 0;
+	}
+	buffer->data = grow;
+	buffer->size = want;
+    }
+    if (data != NULL) {
+	memcpy(buffer->data + buffer->used, data, length);
+	memset(buffer->data + buffer->used + length, 0, padded - length);
+    } else {
+	memset(buffer->data + buffer->used, 0, padded);
+    }
+    buffer->used += padded;
+    return result;
+}
+
+static void
+setCacheValue(CacheBuffer * buffer, size_t offset, size_t value)
+{
+    UINT item = (UINT) value;
+    if (!buffer->failed)
+	memcpy(buffer->data + offset, &item, sizeof(item));
+}
+
+static size_t
+getCacheValue(const UCHAR * data, size_t offset)
+{
+    UINT item;
+    memcpy(&item, data + offset, sizeof(item));
+    return (size_t) item;
+}
+
+/*
+ * Check that an array of "count" items of the given size lies in the file.
+ */
+static int
+validCacheArray(size_t length, size_t offset, size_t count, size_t size)
+{
+    return ((offset % sizeof(UINT)) == 0
+	    && offset <= length
+	    && count <= (length - offset) / size);
+}
+
+/*
+ * Write the given tables to the cache.  Write to a temporary file and rename
+ * it, so that concurrent sessions (which may have the old file mapped) never
+ * see a partial file.
+ */
+static void
+saveCachedTables(const char *encoding_name,
+		 unsigned tag,
+		 LuitConv ** list,
+		 unsigned count)
+{
+    CacheBuffer buffer;
+    char *path;
+    char *temp;
+    char *key;
+    unsigned g;
+    unsigned tables = 0;
+    size_t entry;
+    size_t n;
+
+    if ((path = cachePath(encoding_name, tag)) == NULL)
+	return;
+    if ((key = cacheKey(encoding_name, tag)) == NULL) {
+	free(path);
+	return;
+    }
+
+    beginPhase("cache.save");
+    for (g = 0; g < count; ++g) {
+	if (list[g] != NULL)
+	    ++tables;
+    }
+
+    memset(&buffer, 0, sizeof(buffer));
+    (void) putCacheBytes(&buffer, NULL, CacheItem(CACHE_HEADER));
+    setCacheValue(&buffer, CacheItem(hMagic), CACHE_MAGIC);
+    setCacheValue(&buffer, CacheItem(hFormat), CACHE_FORMAT);
+    setCacheValue(&buffer, CacheItem(hOrder), CACHE_ORDER);
+    setCacheValue(&buffer, CacheItem(hKeyOffset),
+		  putCacheBytes(&buffer, key, strlen(key)));
+    setCacheValue(&buffer, CacheItem(hKeyLength), strlen(key));
+    setCacheValue(&buffer, CacheItem(hTables), tables);
+    entry = putCacheBytes(&buffer, NULL, CacheItem(CACHE_ENTRY * tables));
+    setCacheValue(&buffer, CacheItem(hEntries), entry);
+
+    for (g = 0; g < count; ++g) {
+	LuitConv *data = list[g];
+	const char *name;
+	size_t ucs_at;
+	size_t text_at;
+	size_t index_at;
+	size_t page_at;
+
+	if (data == NULL)
+	    continue;
+
+	name = NonNull(data->encoding_name);
+	setCacheValue(&buffer, entry + CacheItem(eNameOffset),
+		      putCacheBytes(&buffer, name, strlen(name)));
+	setCacheValue(&buffer, entry + CacheItem(eNameLength), strlen(name));
+	setCacheValue(&buffer, entry + CacheItem(eTableSize), data->table_size);
+	setCacheValue(&buffer, entry + CacheItem(eIndexSize), data->len_index);
+
+	ucs_at = putCacheBytes(&buffer, NULL, CacheItem(data->table_size));
+	text_at = putCacheBytes(&buffer, NULL, CacheItem(data->table_size));
+	for (n = 0; n < data->table_size; ++n) {
+	    MappingData *item = &(data->table_utf8[n]);
+	    setCacheValue(&buffer, ucs_at + CacheItem(n), item->ucs);
+	    if (item->text != 0 && item->size != 0 && item->size < 256) {
+		size_t text = putCacheBytes(&buffer,
+					    PoolText(data, n),
+					    item->size);
+		setCacheValue(&buffer, text_at + CacheItem(n),
+			      (text << 8) | item->size);
+	    }
+	}
+	setCacheValue(&buffer, entry + CacheItem(eUcsOffset), ucs_at);
+	setCacheValue(&buffer, entry + CacheItem(eTextOffset), text_at);
+
+	index_at = putCacheBytes(&buffer,
+				 data->rev_index,
+				 data->len_index * sizeof(ReverseData));
+	setCacheValue(&buffer, entry + CacheItem(eIndexOffset), index_at);
+
+	page_at = putCacheBytes(&buffer, NULL, CacheItem(data->rev_rows));
+	for (n = 0; n < data->rev_rows; ++n) {
+	    if (data->rev_pages[n] != NULL) {
+		setCacheValue(&buffer, page_at + CacheItem(n),
+			      putCacheBytes(&buffer,
+					    data->rev_pages[n],
+					    CacheItem(256)));
+	    }
+	}
+	setCacheValue(&buffer, entry + CacheItem(ePageRows), data->rev_rows);
+	setCacheValue(&buffer, entry + CacheItem(ePageOffset), page_at);
+
+	entry += CacheItem(CACHE_ENTRY);
+    }
+    setCacheValue(&buffer, CacheItem(hLength), buffer.used + sizeof(UINT));
+    {
+	UINT check = (UINT) cacheChecksum(buffer.data, buffer.used);
+	(void) putCacheBytes(&buffer, &check, sizeof(check));
+    }
+
+    if (!buffer.failed
+	&& buffer.used < CACHE_LIMIT
+	&& (temp = malloc(strlen(path) + 8)) != NULL) {
+	int fd;
+
+	sprintf(temp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(temp)) >= 0) {
+	    FILE *fp = fdopen(fd, "wb");
+	    int ok = 0;
+
+	    if (fp != NULL) {
+		ok = (fwrite(buffer.data, (size_t) 1, buffer.used, fp) == buffer.used);
+		ok = (fclose(fp) == 0) && ok;
+	    } else {
+		close(fd);
+	    }
+	    if (ok && rename(temp, path) == 0) {
+		VERBOSE(1, ("saved tables for %s in %s\n", encoding_name, path));
+	    } else {
+		unlink(temp);
+	    }
+	}
+	free(temp);
+    }
+    free(buffer.data);
+    free(key);
+    free(path);
+    endPhase();
+}
+
+/*
+ * Check the entire file before any table is constructed.  Return the number
+ * of tables, or zero if the file cannot be used.
+ */
+static size_t
+validCacheData(const UCHAR * data, size_t length, const char *key)
+{
+    size_t tables;
+    size_t entry;
+    size_t g, n;
+
+    if (length < CacheItem(CACHE_HEADER + 1)
+	|| (length % sizeof(UINT)) != 0
+	|| getCacheValue(data, CacheItem(hMagic)) != CACHE_MAGIC
+	|| getCacheValue(data, CacheItem(hFormat)) != CACHE_FORMAT
+	|| getCacheValue(data, CacheItem(hOrder)) != CACHE_ORDER
+	|| getCacheValue(data, CacheItem(hLength)) != length
+	|| getCacheValue(data, length - sizeof(UINT))
+	!= cacheChecksum(data, length - sizeof(UINT))) {
+	TRACE(("...cache header/checksum mismatch\n"));
+	return 0;
+    }
+    length -= sizeof(UINT);
+
+    n = getCacheValue(data, CacheItem(hKeyOffset));
+    if (getCacheValue(data, CacheItem(hKeyLength)) != strlen(key)
+	|| !validCacheArray(length, n, strlen(key), (size_t) 1)
+	|| memcmp(data + n, key, strlen(key))) {
+	TRACE(("...cache key mismatch\n"));
+	return 0;
+    }
+
+    tables = getCacheValue(data, CacheItem(hTables));
+    entry = getCacheValue(data, CacheItem(hEntries));
+    if (!validCacheArray(length, entry, tables, CacheItem(CACHE_ENTRY)))
+	return 0;
+
+    for (g = 0; g < tables; ++g, entry += CacheItem(CACHE_ENTRY)) {
+	size_t table_size = getCacheValue(data, entry + CacheItem(eTableSize));
+	size_t len_index = getCacheValue(data, entry + CacheItem(eIndexSize));
+	size_t text_at = getCacheValue(data, entry + CacheItem(eTextOffset));
+	size_t rows = getCacheValue(data, entry + CacheItem(ePageRows));
+	size_t page_at = getCacheValue(data, entry + CacheItem(ePageOffset));
+
+	if ((table_size != 0 && table_size != MAX8 && table_size != MAX16)
+	    || len_index > table_size
+	    || !validCacheArray(length,
+				getCacheValue(data, entry + CacheItem(eNameOffset)),
+				getCacheValue(data, entry + CacheItem(eNameLength)),
+				(size_t) 1)
+	    || !validCacheArray(length,
+				getCacheValue(data, entry + CacheItem(eUcsOffset)),
+				table_size,
+				sizeof(UINT))
+	    || !validCacheArray(length, text_at, table_size, sizeof(UINT))
+	    || !validCacheArray(length,
+				getCacheValue(data, entry + CacheItem(eIndexOffset)),
+				len_index,
+				sizeof(ReverseData))
+	    || !validCacheArray(length, page_at, rows, sizeof(UINT)))
+	    return 0;
+
+	for (n = 0; n < table_size; ++n) {
+	    size_t text = getCacheValue(data, text_at + CacheItem(n));
+	    if (text != 0
+		&& !validCacheArray(length, text >> 8, text & 0xff, (size_t) 1))
+		return 0;
+	}
+	for (n = 0; n < rows; ++n) {
+	    size_t page = getCacheValue(data, page_at + CacheItem(n));
+	    if (page != 0
+		&& !validCacheArray(length, page, (size_t) 256, sizeof(UINT)))
+		return 0;
+	}
+    }
+    return tables;
+}
+
+/*
+ * Make a private copy of a table from the cache.
+ */
+static LuitConv *
+copyCachedTable(const UCHAR * data, size_t entry)
+{
+    LuitConv *latest;
+    size_t table_size = getCacheValue(data, entry + CacheItem(eTableSize));
+
+    if ((latest = newLuitConv(table_size)) != NULL) {
+	size_t name_at = getCacheValue(data, entry + CacheItem(eNameOffset));
+	size_t name_len = getCacheValue(data, entry + CacheItem(eNameLength));
+	size_t ucs_at = getCacheValue(data, entry + CacheItem(eUcsOffset));
+	size_t text_at = getCacheValue(data, entry + CacheItem(eTextOffset));
+	size_t n;
+
+	if ((latest->encoding_name = malloc(name_len + 1)) != NULL) {
+	    memcpy(latest->encoding_name, data + name_at, name_len);
+	    latest->encoding_name[name_len] = '\0';
+	}
+	latest->iconv_desc = NO_ICONV;
+
+	for (n = 0; n < table_size; ++n) {
+	    MappingData *item = &(latest->table_utf8[n]);
+	    size_t text = getCacheValue(data, text_at + CacheItem(n));
+
+	    item->ucs = (unsigned) getCacheValue(data, ucs_at + CacheItem(n));
+	    if (text != 0) {
+		item->size = text & 0xff;
+		item->text = addPoolText(latest, data + (text >> 8), item->size);
+	    }
+	}
+	latest->len_index = getCacheValue(data, entry + CacheItem(eIndexSize));
+	memcpy(latest->rev_index,
+	       data + getCacheValue(data, entry + CacheItem(eIndexOffset)),
+	       latest->len_index * sizeof(ReverseData));
+	finishIconvTable(latest);
+	initializeReversePages(latest);
+    }
+    return latest;
+}
+
+/*
+ * Make a table which refers to the mapped cache file rather than copying it.
+ * Only the LuitConv and the directory of reverse-index pages are private.
+ */
+static LuitConv *
+viewCachedTable(UCHAR * data, size_t entry)
+{
+    LuitConv *latest;
+
+    if ((latest = TypeCalloc(LuitConv)) != NULL) {
+	size_t name_at = getCacheValue(data, entry + CacheItem(eNameOffset));
+	size_t name_len = getCacheValue(data, entry + CacheItem(eNameLength));
+	size_t page_at = getCacheValue(data, entry + CacheItem(ePageOffset));
+	size_t n;
+
+	if ((latest->encoding_name = malloc(name_len + 1)) != NULL) {
+	    memcpy(latest->encoding_name, data + name_at, name_len);
+	    latest->encoding_name[name_len] = '\0';
+	}
+	latest->iconv_desc = NO_ICONV;
+	latest->table_size = getCacheValue(data, entry + CacheItem(eTableSize));
+	latest->table_ucs = (unsigned *) (void *)
+	    (data + getCacheValue(data, entry + CacheItem(eUcsOffset)));
+	latest->len_index = getCacheValue(data, entry + CacheItem(eIndexSize));
+	latest->rev_index = (ReverseData *) (void *)
+	    (data + getCacheValue(data, entry + CacheItem(eIndexOffset)));
+	latest->rev_rows = getCacheValue(data, entry + CacheItem(ePageRows));
+	if (latest->rev_rows != 0
+	    && (latest->rev_pages = TypeCallocN(unsigned *,
+						latest->rev_rows)) != NULL) {
+	    for (n = 0; n < latest->rev_rows; ++n) {
+		size_t page = getCacheValue(data, page_at + CacheItem(n));
+		if (page != 0)
+		    latest->rev_pages[n] = (unsigned *) (void *) (data + page);
+	    }
+	} else {
+	    latest->rev_rows = 0;
+	}
+	finishIconvTable(latest);
+    }
+    return latest;
+}
+
+/*
+ * Load the tables for the given encoding from a cache file.  With -mmap, the
+ * tables are views of the file mapped read-only, shared with other processes
+ * using the same encoding.  Return the first table.
+ */
+static LuitConv *
+loadCacheFile(const char *path, const char *encoding_name, const char *key)
+{
+    LuitConv *result = NULL;
+    UCHAR *data = NULL;
+    size_t length = 0;
+    int mapped = 0;
+    int fd;
+    struct stat sb;
+
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+	if (fstat(fd, &sb) == 0
+	    && sb.st_size > 0
+	    && sb.st_size < CACHE_LIMIT) {
+	    length = (size_t) sb.st_size;
+#ifdef USE_MMAP
+	    if (mmap_tables) {
+		void *addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, (off_t) 0);
+		if (addr != MAP_FAILED) {
+		    data = addr;
+		    mapped = 1;
+		}
+	    }
+#endif
+	    if (data == NULL
+		&& (data = malloc(length)) != NULL
+		&& read(fd, data, length) != (ssize_t) length) {
+		free(data);
+		data = NULL;
+	    }
+	}
+	close(fd);
+    }
+
+    if (data != NULL) {
+	size_t tables = validCacheData(data, length, key);
+	size_t entry = getCacheValue(data, CacheItem(hEntries));
+	size_t g;
+
+	for (g = 0; g < tables; ++g, entry += CacheItem(CACHE_ENTRY)) {
+	    LuitConv *latest = (mapped
+				? viewCachedTable(data, entry)
+				: copyCachedTable(data, entry));
+	    if (latest == NULL)
+		break;
+	    if (result == NULL) {
+		result = latest;
+		if (mapped) {
+		    latest->shared_data = data;
+		    latest->shared_size = length;
+		}
+	    }
+	}
+	if (result != NULL) {
+	    VERBOSE(1, ("%s tables for %s from %s\n",
+			mapped ? "mapped" : "loaded",
+			encoding_name, path));
+	}
+#ifdef USE_MMAP
+	if (mapped) {
+	    if (result == NULL)
+		munmap(data, length);
+	} else
+#endif
+	    free(data);
+    }
+    return result;
+}
+
+/*
+ * Load the tables for the given encoding from the system-wide cache if it has
+ * them, otherwise from the user's cache.  Return the first table.
+ */
+static LuitConv *
+loadCachedTables(const char *encoding_name, unsigned tag)
+{
+    LuitConv *result = NULL;
+    char *path;
+    char *key;
+
+    if ((key = cacheKey(encoding_name, tag)) == NULL)
+	return NULL;
+
+    beginPhase("cache.load");
+    if ((path = systemCachePath(encoding_name, tag)) != NULL) {
+	result = loadCacheFile(path, encoding_name, key);
+	free(path);
+    }
+    if (result == NULL
+	&& (path = cachePath(encoding_name, tag)) != NULL) {
+	result = loadCacheFile(path, encoding_name, key);
+	free(path);
+    }
+    endPhase();
+
+    free(key);
+    return result;
+}
+
 static int
 knownCharset(const FontencCharsetRec * fc)
 {
@@ -1065,7 +2531,9 @@ loadCompositeCharset(iconv_t my_desc, const char *composite_name)
      * in each one according to the shift-information embedded in the
      * reverse mapping string.
      */
+    beginPhase("iconv.table");
     initialize16bitTable(composite_name, work, gmax);
+    endPhase();
     /*
      * Finally, link the parts into the list of loaded charsets so we
      * will not repeat this process.
@@ -1074,8 +2542,14 @@ loadCompositeCharset(iconv_t my_desc, const char *composite_name)
 	if (work[g] != NULL) {
 	    work[g]->iconv_desc = NO_ICONV;
 	    finishIconvTable(work[g]);
+	    qsort(work[g]->rev_index,
+		  work[g]->len_index,
+		  sizeof(work[g]->rev_index[0]),
+		  cmp_rindex);
+	    initializeReversePages(work[g]);
 	}
     }
+    saveCachedTables(composite_name, 0, work, 4);
     return 0;
 }
 
@@ -1122,14 +2596,20 @@ lookupIconv(const char **encoding_name, char **aliased, US_SIZE size)
     }
     if (my_desc != NO_ICONV) {
 	TRACE(("...iconv_open succeeded\n"));
-	result = initLuitConv(*encoding_name, my_desc, NULL, -1, size);
-	iconv_close(my_desc);
-	if ((latest = luitLookupEncoding(result)) != NULL) {
-	    latest->iconv_desc = NO_ICONV;
+	if ((latest = loadCachedTables(*encoding_name, size)) != NULL) {
+	    result = &(latest->mapping);
+	} else {
+	    result = initLuitConv(*encoding_name, my_desc, NULL, -1, size);
+	    if ((latest = luitLookupEncoding(result)) != NULL) {
+		latest->iconv_desc = NO_ICONV;
+		saveCachedTables(*encoding_name, size, &latest, 1);
+	    }
 	}
+	iconv_close(my_desc);
     } else if ((full = getCompositeCharset(*encoding_name)) != NULL
 	       && (check = try_iconv_open(full, aliased)) != NO_ICONV) {
-	loadCompositeCharset(check, full);
+	if (loadCachedTables(full, 0) == NULL)
+	    loadCompositeCharset(check, full);
 	iconv_close(check);
 	if ((fc = getFontencByName(*encoding_name)) != NULL) {
 	    result = getFontMapByName(fc->name);
@@ -1144,12 +2624,19 @@ luitLookupMapping(const char *encoding_name, UM_MODE mode, US_SIZE size)
     FontMapPtr result = NULL;
     FontEncPtr fontenc;
     const BuiltInCharsetRec *builtIn;
+    const FontencCharsetRec *fc;
     char *aliased = NULL;
 
     TRACE(("luitLookupMapping '%s' mode %u size %u\n",
 	   NonNull(encoding_name), mode, size));
 
-    if ((result = getFontMapByName(encoding_name)) != NULL) {
+    /*
+     * The parts of a composite charset are loaded together, and are listed
+     * by their charset names rather than the xlfd names used for lookup.
+     */
+    if ((result = getFontMapByName(encoding_name)) != NULL
+	|| ((fc = getFontencByName(encoding_name)) != NULL
+	    && (result = getFontMapByName(fc->name)) != NULL)) {
 	TRACE(("...found in cache\n"));
     } else {
 	int n;
@@ -1226,12 +2713,9 @@ luitLookupReverse(FontMapPtr fontmap_ptr)
     LuitConv *search;
 
     TRACE(("luitLookupReverse %p\n", (void *) fontmap_ptr));
-    for (search = all_conversions; search != NULL; search = search->next) {
-	if (fontmap_ptr == &(search->mapping)) {
-	    TRACE(("...found %s\n", NonNull(search->encoding_name)));
-	    result = &(search->reverse);
-	    break;
-	}
+    if ((search = luitLookupEncoding(fontmap_ptr)) != NULL) {
+	TRACE(("...found %s\n", NonNull(search->encoding_name)));
+	result = &(search->reverse);
     }
     return result;
 }
@@ -1243,14 +2727,14 @@ luitMapCodeValue(unsigned code, FontMapPtr fontmap_ptr)
     LuitConv *search;
 
     result = code;
-    for (search = all_conversions; search != NULL; search = search->next) {
-	if (&(search->mapping) == fontmap_ptr) {
-	    if (code < search->table_size) {
+    if ((search = luitLookupEncoding(fontmap_ptr)) != NULL) {
+	if (code < search->table_size) {
+	    if (search->table_utf8 != NULL)
 		result = search->table_utf8[code].ucs;
-		if (result == 0 && code != 0)
-		    result = code;
-	    }
-	    break;
+	    else
+		result = search->table_ucs[code];
+	    if (result == 0 && code != 0)
+		result = code;
 	}
     }
 
@@ -1492,7 +2976,6 @@ void
 luitDestroyReverse(FontMapReversePtr reverse)
 {
     LuitConv *p, *q;
-    size_t n;
 
     for (p = all_conversions, q = NULL; p != NULL; q = p, p = p->next) {
 	if (&(p->reverse) == reverse) {
@@ -1501,19 +2984,21 @@ luitDestroyReverse(FontMapReversePtr reverse)
 	    if (p->iconv_desc != NO_ICONV)
 		iconv_close(p->iconv_desc);
 
-	    for (n = 0; n < p->table_size; ++n) {
-		if (p->table_utf8[n].text) {
-		    free(p->table_utf8[n].text);
-		}
-	    }
+	    /* a view of a mapped file has no private tables */
+	    free(p->table_utf8);
+	    free(p->text_pool);
+	    free(p->page_pool);
+	    free(p->rev_pages);
+#ifdef USE_MMAP
+	    if (p->shared_data != NULL)
+		munmap(p->shared_data, p->shared_size);
+#endif
 
 	    /* delink and destroy */
 	    if (q != NULL)
 		q->next = p->next;
 	    else
 		all_conversions = p->next;
-	    free(p->table_utf8);
-	    free(p->rev_index);
 	    free(p);
 	    break;
 	}
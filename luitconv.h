@@ -51,6 +51,7 @@ typedef struct _FontMap {
     unsigned (*recode) (unsigned, void *);	/* mapping function */
     void *client_data;		/* second parameter of the two above */
     struct _FontMap *next;	/* link to next element in list */
+    struct _LuitConv *conv;	/* the LuitConv which owns this, if any */
 } FontMapRec, *FontMapPtr;
 
 typedef struct _FontMapReverse {
@@ -72,8 +73,8 @@ typedef struct _FontEnc {
 } FontEncRec, *FontEncPtr;
 
 typedef struct {
-    size_t size;		/* length of text[] */
-    char *text;			/* value, in UTF-8 */
+    size_t size;		/* length of text */
+    size_t text;		/* value, in UTF-8, as offset in text_pool[] */
     unsigned ucs;		/* corresponding Unicode value */
 } MappingData;
 
@@ -88,9 +89,19 @@ typedef struct _LuitConv {
     iconv_t iconv_desc;
     /* internal tables for input/output */
     MappingData *table_utf8;	/* UTF-8 equivalents of 8-bit codes */
-    ReverseData *rev_index;	/* reverse-index */
+    ReverseData *rev_index;	/* reverse-index, sorted by Unicode value */
     size_t len_index;		/* index length */
+    unsigned **rev_pages;	/* reverse-index, by Unicode "row" */
+    size_t rev_rows;		/* length of rev_pages[] */
     size_t table_size;		/* length of table_utf8[] and rev_index[] */
+    char *text_pool;		/* null-terminated strings for table_utf8[] */
+    size_t text_used;		/* bytes used in text_pool[] */
+    size_t text_size;		/* bytes allocated for text_pool[] */
+    unsigned *page_pool;	/* storage for the pages in rev_pages[] */
+    /* read-only view of a mapped cache file, used instead of table_utf8 */
+    unsigned *table_ucs;	/* Unicode values, by code */
+    void *shared_data;		/* the mapping, if this owns it */
+    size_t shared_size;		/* length of shared_data */
     /* data expected by caller */
     FontMapRec mapping;
     FontMapReverseRec reverse;
@@ -40,6 +40,7 @@
 #	$3 = final installed-path
 #	$4 = top-level application directory
 #	$5 = path of locale.alias
+#	$6 = system-wide directory of cached tables
 #
 
 # override locale...
@@ -59,6 +60,7 @@ OLD_FILE="$2"
 END_FILE="$3"
 ROOT_DIR="$4"
 ALIAS_IS="$5"
+CACHE_IS="$6"
 
 suffix=`echo "$END_FILE" | sed -e 's%^.*\.%%'`
 NEW_FILE=temp$$
@@ -95,6 +97,7 @@ sed	-e 's%__vendorversion__%"X Window System"%' \
 	-e "s%__mansuffix__%$MY_MANSECT%g" \
 	-e "s%__miscmansuffix__%$X_MANSECT%g" \
 	-e "s%__locale_alias__%$ALIAS_IS%g" \
+	-e "s%__cache_dir__%$CACHE_IS%g" \
 	-e "s%$OLD_LOWER%$NEW_LOWER%g" \
 	-e "s%$OLD_UPPER%$NEW_UPPER%g" \
 	-e "s%$OLD_FIRST%$NEW_FIRST%g" \
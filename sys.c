@@ -29,6 +29,7 @@ THE SOFTWARE.
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <sys/time.h>
 #include <termios.h>
 #include <signal.h>
@@ -38,6 +39,15 @@ THE SOFTWARE.
 #include <grp.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
 #ifdef HAVE_WORKING_POLL
 #ifdef HAVE_POLL_H
 #include <poll.h>
@@ -115,6 +125,7 @@ waitForOutput(int fd)
     pfd[0].events = POLLOUT;
     pfd[0].revents = 0;
 
+    PROBE1(wait_output_entry, fd);
     rc = poll(pfd, (nfds_t) 1, -1);
     if (rc < 0) {
 	ret = -1;
@@ -129,6 +140,7 @@ waitForOutput(int fd)
 
     FD_ZERO(&fds);
     FD_SET(fd, &fds);
+    PROBE1(wait_output_entry, fd);
     rc = select(FD_SETSIZE, NULL, &fds, NULL, NULL);
     if (rc < 0) {
 	ret = -1;
@@ -141,11 +153,209 @@ waitForOutput(int fd)
     ret = IO_CanWrite;
 #endif
 
+    PROBE2(wait_output_return, fd, ret);
+    return ret;
+}
+
+#ifdef USE_EPOLL
+/*
+ * With epoll, the descriptors are registered once, by setupWaitForIO(), and
+ * changed only when the events of interest change.  SIGWINCH and SIGCHLD are
+ * blocked, and read from a signalfd, so they cannot be lost between checking
+ * for them and waiting.  If the system supports it, a pidfd also reports the
+ * exit of the child.
+ */
+#define EP_FD1		0
+#define EP_FD2		1
+#define EP_SIGNAL	2
+#define EP_CHILD	3
+
+static int epoll_fd = -1;
+static int epoll_fds[4] =
+{-1, -1, -1, -1};
+static unsigned epoll_events[2];
+static sigset_t epoll_sigmask;
+
+static int
+epollControl(int slot, unsigned events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (events == epoll_events[slot])
+	return 0;
+    if (events == 0)
+	op = EPOLL_CTL_DEL;
+    else if (epoll_events[slot] == 0)
+	op = EPOLL_CTL_ADD;
+    else
+	op = EPOLL_CTL_MOD;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = (unsigned) slot;
+    if (epoll_ctl(epoll_fd, op, epoll_fds[slot], &ev) < 0)
+	return -1;
+    epoll_events[slot] = events;
+    return 0;
+}
+
+static int
+epollWaitForIO(int want)
+{
+    struct epoll_event events[4];
+    unsigned want1 = 0;
+    unsigned want2 = 0;
+    int ret = 0;
+    int rc;
+    int n;
+
+    if (want & IO_CanRead)
+	want1 |= EPOLLIN;
+    if (want & IO_OutReady)
+	want1 |= EPOLLOUT;
+    if (want & IO_CanWrite)
+	want2 |= EPOLLIN;
+    if (want & IO_InReady)
+	want2 |= EPOLLOUT;
+
+    /* an fd with no events of interest is removed, to ignore EPOLLHUP */
+    if (epollControl(EP_FD1, want1) < 0
+	|| epollControl(EP_FD2, want2) < 0)
+	return IO_Closed;
+
+    rc = epoll_wait(epoll_fd, events, (int) SizeOf(events), -1);
+    if (rc < 0)
+	return -1;
+
+    for (n = 0; n < rc; ++n) {
+	unsigned got = events[n].events;
+
+	switch (events[n].data.u32) {
+	case EP_FD1:
+	    if (got & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		ret |= (want & IO_CanRead);
+	    if (got & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+		ret |= (want & IO_OutReady);
+	    break;
+	case EP_FD2:
+	    if (got & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		ret |= (want & IO_CanWrite);
+	    if (got & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+		ret |= (want & IO_InReady);
+	    break;
+	case EP_SIGNAL:
+	    {
+		struct signalfd_siginfo info;
+
+		while (read(epoll_fds[EP_SIGNAL], &info, sizeof(info))
+		       == (ssize_t) sizeof(info)) {
+#ifdef SIGWINCH
+		    if (info.ssi_signo == SIGWINCH)
+			ret |= IO_WinSize;
+#endif
+		    if (info.ssi_signo == SIGCHLD)
+			ret |= IO_ChildExit;
+		}
+	    }
+	    break;
+	case EP_CHILD:
+	    /* the pidfd stays readable; report the exit only once */
+	    ret |= IO_ChildExit;
+	    (void) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, epoll_fds[EP_CHILD], NULL);
+	    close(epoll_fds[EP_CHILD]);
+	    epoll_fds[EP_CHILD] = -1;
+	    break;
+	}
+    }
     return ret;
 }
+#endif /* USE_EPOLL */
 
+/*
+ * Prepare for waitForIO() with the given descriptors, and the child process.
+ * This is needed only for the epoll backend; if it fails, or is not
+ * configured, waitForIO() uses poll or select.
+ */
 int
-waitForInput(int fd1, int fd2)
+setupWaitForIO(int fd1, int fd2, int pid)
+{
+    int rc = -1;
+
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    sigset_t mask;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	return -1;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+#ifdef SIGWINCH
+    sigaddset(&mask, SIGWINCH);
+#endif
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = EP_SIGNAL;
+    if (sigprocmask(SIG_BLOCK, &mask, &epoll_sigmask) < 0
+	|| (epoll_fds[EP_SIGNAL] = signalfd(-1, &mask,
+					    SFD_NONBLOCK | SFD_CLOEXEC)) < 0
+	|| epoll_ctl(epoll_fd, EPOLL_CTL_ADD, epoll_fds[EP_SIGNAL], &ev) < 0) {
+	cleanupWaitForIO();
+	return -1;
+    }
+
+#if defined(SYS_pidfd_open)
+    if (pid > 0
+	&& (epoll_fds[EP_CHILD] = (int) syscall(SYS_pidfd_open, pid, 0)) >= 0) {
+	ev.data.u32 = EP_CHILD;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, epoll_fds[EP_CHILD], &ev) < 0) {
+	    close(epoll_fds[EP_CHILD]);
+	    epoll_fds[EP_CHILD] = -1;
+	}
+    }
+#else
+    (void) pid;
+#endif
+
+    epoll_fds[EP_FD1] = fd1;
+    epoll_fds[EP_FD2] = fd2;
+    epoll_events[EP_FD1] = 0;
+    epoll_events[EP_FD2] = 0;
+    TRACE(("setupWaitForIO epoll %d, signalfd %d, pidfd %d\n",
+	   epoll_fd, epoll_fds[EP_SIGNAL], epoll_fds[EP_CHILD]));
+    rc = 0;
+#else
+    (void) fd1;
+    (void) fd2;
+    (void) pid;
+#endif
+    return rc;
+}
+
+void
+cleanupWaitForIO(void)
+{
+#ifdef USE_EPOLL
+    if (epoll_fd >= 0) {
+	if (epoll_fds[EP_SIGNAL] >= 0) {
+	    close(epoll_fds[EP_SIGNAL]);
+	    sigprocmask(SIG_SETMASK, &epoll_sigmask, NULL);
+	}
+	if (epoll_fds[EP_CHILD] >= 0)
+	    close(epoll_fds[EP_CHILD]);
+	close(epoll_fd);
+	epoll_fd = -1;
+	epoll_fds[EP_FD1] = -1;
+	epoll_fds[EP_FD2] = -1;
+	epoll_fds[EP_SIGNAL] = -1;
+	epoll_fds[EP_CHILD] = -1;
+    }
+#endif
+}
+
+static int
+pollWaitForIO(int fd1, int fd2, int want)
 {
     int ret = 0;
 
@@ -155,17 +365,33 @@ waitForInput(int fd1, int fd2)
 
     pfd[0].fd = fd1;
     pfd[1].fd = fd2;
-    pfd[0].events = pfd[1].events = POLLIN;
+    pfd[0].events = pfd[1].events = 0;
     pfd[0].revents = pfd[1].revents = 0;
+    if (want & IO_CanRead)
+	pfd[0].events |= POLLIN;
+    if (want & IO_OutReady)
+	pfd[0].events |= POLLOUT;
+    if (want & IO_CanWrite)
+	pfd[1].events |= POLLIN;
+    if (want & IO_InReady)
+	pfd[1].events |= POLLOUT;
+    if (pfd[0].events == 0)
+	pfd[0].fd = -1;
+    if (pfd[1].events == 0)
+	pfd[1].fd = -1;
 
     rc = poll(pfd, (nfds_t) 2, -1);
     if (rc < 0) {
 	ret = -1;
     } else {
 	if (pfd[0].revents & (POLLIN | POLLERR | POLLHUP))
-	    ret |= IO_CanRead;
+	    ret |= (want & IO_CanRead);
+	if (pfd[0].revents & (POLLOUT | POLLERR | POLLHUP))
+	    ret |= (want & IO_OutReady);
 	if (pfd[1].revents & (POLLIN | POLLERR | POLLHUP))
-	    ret |= IO_CanWrite;
+	    ret |= (want & IO_CanWrite);
+	if (pfd[1].revents & (POLLOUT | POLLERR | POLLHUP))
+	    ret |= (want & IO_InReady);
 	if (pfd[0].revents & (POLLNVAL))
 	    ret |= IO_Closed;
 	if (pfd[1].revents & (POLLNVAL))
@@ -173,30 +399,151 @@ waitForInput(int fd1, int fd2)
     }
 
 #elif defined(HAVE_WORKING_SELECT)
-    fd_set fds;
+    fd_set rfds;
+    fd_set wfds;
     int rc;
 
-    FD_ZERO(&fds);
-    FD_SET(fd1, &fds);
-    FD_SET(fd2, &fds);
-    rc = select(FD_SETSIZE, &fds, NULL, NULL, NULL);
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    if (want & IO_CanRead)
+	FD_SET(fd1, &rfds);
+    if (want & IO_OutReady)
+	FD_SET(fd1, &wfds);
+    if (want & IO_CanWrite)
+	FD_SET(fd2, &rfds);
+    if (want & IO_InReady)
+	FD_SET(fd2, &wfds);
+    rc = select(FD_SETSIZE, &rfds, &wfds, NULL, NULL);
     if (rc < 0) {
 	ret = -1;
 	if (errno == EBADF)
 	    ret = IO_Closed;
     } else {
-	if (FD_ISSET(fd1, &fds))
+	if (FD_ISSET(fd1, &rfds))
 	    ret |= IO_CanRead;
-	if (FD_ISSET(fd2, &fds))
+	if (FD_ISSET(fd1, &wfds))
+	    ret |= IO_OutReady;
+	if (FD_ISSET(fd2, &rfds))
 	    ret |= IO_CanWrite;
+	if (FD_ISSET(fd2, &wfds))
+	    ret |= IO_InReady;
     }
 #else
-    ret = (IO_CanRead | IO_CanWrite);
+    ret = want;
 #endif
 
     return ret;
 }
 
+/*
+ * Like waitForInput(), but also check if the descriptors can accept output.
+ * The "want" parameter selects the events of interest, using the same flags
+ * as the return value.  A descriptor with no events of interest is ignored.
+ */
+int
+waitForIO(int fd1, int fd2, int want)
+{
+#ifdef USE_EPOLL
+    if (epoll_fd >= 0
+	&& fd1 == epoll_fds[EP_FD1]
+	&& fd2 == epoll_fds[EP_FD2])
+	return epollWaitForIO(want);
+#endif
+    return pollWaitForIO(fd1, fd2, want);
+}
+
+int
+waitForInput(int fd1, int fd2)
+{
+    return waitForIO(fd1, fd2, IO_CanRead | IO_CanWrite);
+}
+
+/*
+ * Return the current time in seconds, for measuring intervals.  Use the
+ * monotonic clock if possible, since the wall clock may be stepped.
+ */
+double
+getSeconds(void)
+{
+    struct timeval now;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1.0e9;
+#endif
+
+    gettimeofday(&now, NULL);
+    return (double) now.tv_sec + (double) now.tv_usec / 1.0e6;
+}
+
+/*
+ * The C library declares splice() and tee() only for _GNU_SOURCE, so use the
+ * system calls, as for pidfd_open.
+ */
+#if defined(SYS_splice) && defined(SYS_tee)
+#define USE_SPLICE 1
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE     1
+#endif
+#ifndef SPLICE_F_NONBLOCK
+#define SPLICE_F_NONBLOCK 2
+#endif
+#endif
+
+/*
+ * Move up to "count" bytes from one descriptor to another without copying
+ * them through user space.  One of the descriptors must be a pipe.  Return the
+ * number of bytes moved, or -1, with errno set to EINVAL if the system or the
+ * descriptors do not support this.
+ */
+int
+spliceBytes(int from, int to, size_t count)
+{
+#ifdef USE_SPLICE
+    long rc;
+
+    do {
+	rc = syscall(SYS_splice, from, NULL, to, NULL, count,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0 && errno == ENOSYS)
+	errno = EINVAL;
+    return (int) rc;
+#else
+    (void) from;
+    (void) to;
+    (void) count;
+    errno = EINVAL;
+    return -1;
+#endif
+}
+
+/*
+ * Copy up to "count" bytes from one pipe to another, leaving them in the
+ * first.  Return the number of bytes copied, or -1 as for spliceBytes().
+ */
+int
+teeBytes(int from, int to, size_t count)
+{
+#ifdef USE_SPLICE
+    long rc;
+
+    do {
+	rc = syscall(SYS_tee, from, to, count, SPLICE_F_NONBLOCK);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0 && errno == ENOSYS)
+	errno = EINVAL;
+    return (int) rc;
+#else
+    (void) from;
+    (void) to;
+    (void) count;
+    errno = EINVAL;
+    return -1;
+#endif
+}
+
 int
 setWindowSize(int sfd, int dfd)
 {
@@ -37,6 +37,10 @@ extern int ignore_unused;
 #define IO_CanRead   1
 #define IO_CanWrite  2
 #define IO_Closed    4
+#define IO_OutReady  8		/* first descriptor can accept output */
+#define IO_InReady   16		/* second descriptor can accept output */
+#define IO_WinSize   32		/* SIGWINCH was received */
+#define IO_ChildExit 64		/* SIGCHLD was received, or child exited */
 
 #define TypeCalloc(type)    (type *) calloc((size_t) 1, sizeof(type))
 #define TypeCallocN(type,n) (type *) calloc((size_t) (n), sizeof(type))
@@ -45,6 +49,12 @@ extern int ignore_unused;
 
 int waitForOutput(int fd);
 int waitForInput(int fd1, int fd2);
+int waitForIO(int fd1, int fd2, int want);
+int setupWaitForIO(int fd1, int fd2, int pid);
+void cleanupWaitForIO(void);
+double getSeconds(void);
+int spliceBytes(int from, int to, size_t count);
+int teeBytes(int from, int to, size_t count);
 int setWindowSize(int sfd, int dfd);
 int installHandler(int signum, void (*handler) (int));
 int copyTermios(int sfd, int dfd);
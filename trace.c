@@ -25,8 +25,217 @@ THE SOFTWARE.
 #include <config.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define USE_MMAP 1
+#include <sys/mman.h>
+#endif
+
+#include <sys.h>
 #include <trace.h>
 
+/*
+ * If $LUIT_TRACE is set, TRACE_EVENT() writes fixed-size records to a ring
+ * buffer in the file "$LUIT_TRACE.<pid>", which is mapped into memory.  The
+ * file is usable after a crash, and "luit -show-trace" decodes it.
+ */
+#define TRACE_MAGIC   "luitring"
+#define TRACE_VERSION 1
+#define TRACE_RECORDS (1U << 16)	/* a power of two */
+
+typedef struct {
+    char magic[8];
+    unsigned version;
+    unsigned record_size;	/* sizeof(TraceRecord) */
+    unsigned records;		/* number of records in the ring */
+    unsigned pid;
+    unsigned start_sec;		/* wall-clock time when the ring was made */
+    unsigned start_usec;
+    unsigned next;		/* number of records ever written */
+    unsigned spare[5];
+} TraceHeader;
+
+typedef struct {
+    unsigned sec;		/* time since the ring was made */
+    unsigned nsec;
+    unsigned event;		/* TRACE_EV */
+    unsigned arg[3];
+} TraceRecord;
+
+void *trace_ring = NULL;
+
+static TraceHeader *ring_header;
+static TraceRecord *ring_records;
+static struct timespec ring_start;
+
+/* *INDENT-OFF* */
+static const struct {
+    const char *name;
+    int hex;			/* show arguments in hexadecimal */
+    const char *args[3];
+} trace_events[] = {
+    { "none",        0, { NULL,   NULL,     NULL } },
+    { "recode",      1, { "code", "result", NULL } },
+    { "reverse",     1, { "code", "result", NULL } },
+    { "luitReverse", 1, { "code", "result", NULL } },
+    { "read",        0, { "fd",   "count",  NULL } },
+    { "write",       0, { "fd",   "count",  "result" } },
+    { "wait",        1, { "want", "result", NULL } },
+};
+/* *INDENT-ON* */
+
+static void
+getTimestamp(struct timespec *ts)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+#endif
+}
+
+/*
+ * Check $LUIT_TRACE, and if it is set, create the ring buffer.
+ */
+void
+TraceOpen(void)
+{
+#ifdef USE_MMAP
+    const char *prefix = getenv("LUIT_TRACE");
+    size_t length = sizeof(TraceHeader) + TRACE_RECORDS * sizeof(TraceRecord);
+    char *path;
+    void *data;
+    int fd;
+
+    if (IsEmpty(prefix) || trace_ring != NULL)
+	return;
+    if ((path = malloc(strlen(prefix) + 20)) == NULL)
+	return;
+    sprintf(path, "%s.%ld", prefix, (long) getpid());
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+	if (ftruncate(fd, (off_t) length) == 0
+	    && (data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, (off_t) 0)) != MAP_FAILED) {
+	    struct timeval now;
+
+	    ring_header = (TraceHeader *) data;
+	    ring_records = (TraceRecord *) (ring_header + 1);
+
+	    gettimeofday(&now, NULL);
+	    getTimestamp(&ring_start);
+	    memcpy(ring_header->magic, TRACE_MAGIC, sizeof(ring_header->magic));
+	    ring_header->version = TRACE_VERSION;
+	    ring_header->record_size = (unsigned) sizeof(TraceRecord);
+	    ring_header->records = TRACE_RECORDS;
+	    ring_header->pid = (unsigned) getpid();
+	    ring_header->start_sec = (unsigned) now.tv_sec;
+	    ring_header->start_usec = (unsigned) now.tv_usec;
+	    ring_header->next = 0;
+	    trace_ring = data;
+	}
+	close(fd);
+    }
+    if (trace_ring == NULL)
+	perror(path);
+    free(path);
+#endif
+}
+
+/*
+ * Write one record to the ring buffer, overwriting the oldest.
+ */
+void
+TraceEvent(TRACE_EV event, unsigned a, unsigned b, unsigned c)
+{
+    struct timespec now;
+    TraceRecord *p = ring_records + (ring_header->next++ & (TRACE_RECORDS - 1));
+
+    getTimestamp(&now);
+    if (now.tv_nsec < ring_start.tv_nsec) {
+	now.tv_nsec += 1000000000L;
+	now.tv_sec--;
+    }
+    p->sec = (unsigned) (now.tv_sec - ring_start.tv_sec);
+    p->nsec = (unsigned) (now.tv_nsec - ring_start.tv_nsec);
+    p->event = (unsigned) event;
+    p->arg[0] = a;
+    p->arg[1] = b;
+    p->arg[2] = c;
+}
+
+/*
+ * Decode a ring buffer file, listing the records from oldest to newest.
+ */
+int
+showTraceRing(const char *filename)
+{
+    FILE *fp;
+    TraceHeader header;
+    TraceRecord *records = NULL;
+    int rc = EXIT_FAILURE;
+
+    if ((fp = fopen(filename, "rb")) == NULL) {
+	perror(filename);
+    } else if (fread(&header, sizeof(header), (size_t) 1, fp) != 1
+	       || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+	       || header.version != TRACE_VERSION
+	       || header.record_size != sizeof(TraceRecord)
+	       || header.records == 0
+	       || (header.records & (header.records - 1)) != 0) {
+	fprintf(stderr, "%s: not a luit trace file\n", filename);
+    } else if ((records = TypeCallocN(TraceRecord, header.records)) == NULL
+	       || fread(records, sizeof(TraceRecord), (size_t) header.records, fp)
+	       != header.records) {
+	fprintf(stderr, "%s: cannot read records\n", filename);
+    } else {
+	unsigned first = 0;
+	unsigned n;
+
+	if (header.next > header.records)
+	    first = header.next - header.records;
+	printf("# pid %u, started %u.%06u, %u events, %u shown\n",
+	       header.pid,
+	       header.start_sec,
+	       header.start_usec,
+	       header.next,
+	       header.next - first);
+	for (n = first; n != header.next; ++n) {
+	    const TraceRecord *p = records + (n & (header.records - 1));
+	    unsigned k;
+
+	    printf("%u.%09u", p->sec, p->nsec);
+	    if (p->event < (unsigned) evLAST) {
+		printf(" %s", trace_events[p->event].name);
+		for (k = 0; k < 3 && trace_events[p->event].args[k]; ++k) {
+		    if (trace_events[p->event].hex)
+			printf(" %s=%#x", trace_events[p->event].args[k], p->arg[k]);
+		    else
+			printf(" %s=%d", trace_events[p->event].args[k], (int) p->arg[k]);
+		}
+	    } else {
+		printf(" event%u %#x %#x %#x",
+		       p->event, p->arg[0], p->arg[1], p->arg[2]);
+	    }
+	    printf("\n");
+	}
+	rc = EXIT_SUCCESS;
+    }
+    if (fp != NULL)
+	fclose(fp);
+    free(records);
+    return rc;
+}
+
 void
 Trace(const char *fmt, ...)
 {
@@ -27,7 +27,27 @@ THE SOFTWARE.
 
 #include <luit.h>
 
+/*
+ * Events which can be recorded in the ring buffer named by $LUIT_TRACE,
+ * rather than formatted by Trace().
+ */
+typedef enum {
+    evNONE = 0
+    ,evRECODE			/* FontencCharsetRecode: code, result */
+    ,evREVERSE			/* FontencCharsetReverse: code, result */
+    ,evLUITREVERSE		/* luitReverse: code, result */
+    ,evREAD			/* parent: fd, count */
+    ,evWRITE			/* writeBytes: fd, count, result */
+    ,evWAIT			/* parent: want, result */
+    ,evLAST
+} TRACE_EV;
+
 void Trace(const char *fmt, ...) GCC_PRINTFLIKE(1,2);
+void TraceOpen(void);
+void TraceEvent(TRACE_EV event, unsigned a, unsigned b, unsigned c);
+int showTraceRing(const char *filename);
+
+extern void *trace_ring;
 
 #ifdef OPT_TRACE
 #define TRACE(params) Trace params
@@ -36,9 +56,38 @@ void Trace(const char *fmt, ...) GCC_PRINTFLIKE(1,2);
 #else
 #define TRACE2(params)		/* nothing */
 #endif
+#define TRACE_OPEN() TraceOpen()
+#define TRACE_EVENT(event,a,b,c,params) do { \
+	if (trace_ring != NULL) \
+	    TraceEvent(event, (unsigned) (a), (unsigned) (b), (unsigned) (c)); \
+	else \
+	    Trace params; \
+    } while (0)
 #else
 #define TRACE(params)		/* nothing */
 #define TRACE2(params)		/* nothing */
+#define TRACE_OPEN()		/* nothing */
+#define TRACE_EVENT(event,a,b,c,params)	/* nothing */
+#endif
+
+/*
+ * Static probes in the "luit" provider, for perf, bpftrace or systemtap.
+ * These are compiled only with --enable-sdt, and cost a no-op instruction
+ * when not in use.
+ */
+#ifdef USE_SDT
+#include <sys/sdt.h>
+#define PROBE0(name)		DTRACE_PROBE(luit, name)
+#define PROBE1(name,a)		DTRACE_PROBE1(luit, name, a)
+#define PROBE2(name,a,b)	DTRACE_PROBE2(luit, name, a, b)
+#define PROBE3(name,a,b,c)	DTRACE_PROBE3(luit, name, a, b, c)
+#define PROBE4(name,a,b,c,d)	DTRACE_PROBE4(luit, name, a, b, c, d)
+#else
+#define PROBE0(name)		/* nothing */
+#define PROBE1(name,a)		/* nothing */
+#define PROBE2(name,a,b)	/* nothing */
+#define PROBE3(name,a,b,c)	/* nothing */
+#define PROBE4(name,a,b,c,d)	/* nothing */
 #endif
 
 #define TRACE_ERR(msg) TRACE((msg ": %s\n", NonNull(strerror(errno))))